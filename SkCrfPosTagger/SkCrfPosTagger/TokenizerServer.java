@@ -0,0 +1,83 @@
+// author: Dalibor Mészáros
+// name: long-running Stanford tokenizer used by SkCrfPosTagger with "-t coprocess"
+//
+// Reads requests from standard input, every request is "<length in bytes>\n<UTF-8 text>".
+// Answers "<length in bytes>\n<UTF-8 tokens>" with one token per line and an empty line after
+// every sentence, the same as the pipeline
+//   DocumentPreprocessor -tokenizerOptions "asciiQuotes=true" | PTBTokenizer -options "tokenizeNLs=true,asciiQuotes=true"
+// once its *NL* markers are replaced by empty lines. Ends at the end of standard input.
+//
+// compile: javac -cp stanford-parser.jar TokenizerServer.java
+
+import java.io.BufferedInputStream;
+import java.io.BufferedOutputStream;
+import java.io.ByteArrayOutputStream;
+import java.io.DataInputStream;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.OutputStream;
+import java.io.StringReader;
+import java.nio.charset.StandardCharsets;
+import java.util.List;
+
+import edu.stanford.nlp.ling.CoreLabel;
+import edu.stanford.nlp.ling.HasWord;
+import edu.stanford.nlp.process.CoreLabelTokenFactory;
+import edu.stanford.nlp.process.DocumentPreprocessor;
+import edu.stanford.nlp.process.PTBTokenizer;
+import edu.stanford.nlp.process.TokenizerFactory;
+
+public class TokenizerServer {
+
+	private static final String NEWLINE_TOKEN = "*NL*";
+
+	// reads the length line of a request, null at the end of input
+	private static String readHeader(InputStream in) throws IOException {
+		ByteArrayOutputStream header = new ByteArrayOutputStream();
+		int c;
+		while ((c = in.read()) != '\n') {
+			if (c < 0)
+				return null;
+			if (c != '\r')
+				header.write(c);
+		}
+		return header.toString("US-ASCII");
+	}
+
+	public static void main(String[] args) throws IOException {
+		DataInputStream in = new DataInputStream(new BufferedInputStream(System.in));
+		OutputStream out = new BufferedOutputStream(System.out);
+		TokenizerFactory<CoreLabel> splitter = PTBTokenizer.factory(new CoreLabelTokenFactory(), "asciiQuotes=true");
+		TokenizerFactory<CoreLabel> tokenizer = PTBTokenizer.factory(new CoreLabelTokenFactory(), "tokenizeNLs=true,asciiQuotes=true");
+		String header;
+
+		while ((header = readHeader(in)) != null) {
+			byte[] request = new byte[Integer.parseInt(header.trim())];
+			in.readFully(request);
+
+			DocumentPreprocessor sentences = new DocumentPreprocessor(new StringReader(new String(request, StandardCharsets.UTF_8)));
+			sentences.setTokenizerFactory(splitter);
+			StringBuilder response = new StringBuilder();
+			for (List<HasWord> sentence : sentences) {
+				// second stage of the pipeline tokenizes every sentence line again
+				StringBuilder line = new StringBuilder();
+				for (HasWord word : sentence) {
+					if (line.length() > 0)
+						line.append(' ');
+					line.append(word.word());
+				}
+				line.append('\n');
+				for (CoreLabel token : tokenizer.getTokenizer(new StringReader(line.toString())).tokenize()) {
+					if (!NEWLINE_TOKEN.equals(token.word()))
+						response.append(token.word());
+					response.append('\n');
+				}
+			}
+
+			byte[] bytes = response.toString().getBytes(StandardCharsets.UTF_8);
+			out.write((bytes.length + "\n").getBytes(StandardCharsets.US_ASCII));
+			out.write(bytes);
+			out.flush();
+		}
+	}
+}
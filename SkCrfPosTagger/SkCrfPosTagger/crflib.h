@@ -0,0 +1,351 @@
+﻿// author:	Dalibor Mészáros
+// version:	0.01 in-process replacement for "crfsuite.exe tag"
+//
+// Reads models trained by CRFsuite (1st-order linear-chain CRF, "lCRF" files)
+// and decodes them with the same Viterbi algorithm as CRFsuite does.
+
+#ifndef CRFLIB_H
+#define CRFLIB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <ctype.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "denralib.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////  MODEL FILE LAYOUT
+
+#define CRF_FILEMAGIC			"lCRF"
+#define CRF_CQDB_CHUNKID		"CQDB"
+#define CRF_CQDB_BYTEORDER		0x62445371
+#define CRF_HEADER_SIZE			48
+#define CRF_CHUNK_SIZE			12
+#define CRF_FEATURE_SIZE		20
+#define CRF_CQDB_HEADER_SIZE	24
+#define CRF_FEATURE_STATE		0
+#define CRF_FEATURE_TRANSITION	1
+#define CRF_GROUP_NUMBERS_MAX	1024
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////  STRUCTURES
+
+// attributes "name=value" sharing one name, e.g. all "w[-1]=..." of the model
+typedef struct crf_attribute_group {
+	std::unordered_map<std::string, int> values;		// value -> attribute id
+	std::vector<int> numbers;							// attribute id of values "0", "1", ..., -1 if unknown
+}CRF_ATTRIBUTE_GROUP;
+
+// model loaded in memory; stays resident for all documents
+typedef struct crf_model {
+	int labels_count;
+	int attributes_count;
+	std::vector<std::string> labels;					// label id -> label name
+	std::unordered_map<std::string, int> attributes;	// attribute name -> attribute id
+	std::unordered_map<std::string, int> group_ids;		// name before '=' -> group
+	std::vector<CRF_ATTRIBUTE_GROUP> groups;
+	std::vector<size_t> state_begin;					// first state feature of attribute, one extra at the end
+	std::vector<int> state_label;						// state features sorted by attribute
+	std::vector<double> state_weight;
+	std::vector<double> transition;						// transition weights [from * labels_count + to]
+}CRF_MODEL;
+
+// one sequence (sentence) to be tagged; attributes of all items are stored one after another
+typedef struct crf_instance {
+	std::vector<int> attributes;						// attribute ids known to the model
+	std::vector<size_t> item_begin;						// first attribute of each item
+}CRF_INSTANCE;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////  MODEL
+
+inline unsigned int CrfReadUint32(const unsigned char *arg_p) {
+	return (unsigned int)arg_p[0] | ((unsigned int)arg_p[1] << 8) | ((unsigned int)arg_p[2] << 16) | ((unsigned int)arg_p[3] << 24);
+}
+
+inline double CrfReadDouble(const unsigned char *arg_p) {
+	double value;
+	memcpy(&value, arg_p, sizeof(double));
+	return value;
+}
+
+// reads all keys of a constant quark database chunk into arg_keys (indexed by id)
+BOOL CrfReadCqdb(const std::vector<unsigned char> &arg_buffer, size_t arg_offset, size_t arg_count, std::vector<std::string> &arg_keys) {
+	const unsigned char *chunk, *record;
+	size_t i, chunk_size, backward_size, backward_offset, record_offset, key_size;
+
+	if (arg_offset + CRF_CQDB_HEADER_SIZE > arg_buffer.size())
+		return FALSE;
+	chunk = &arg_buffer[arg_offset];
+	if (memcmp(chunk, CRF_CQDB_CHUNKID, 4) != 0 || CrfReadUint32(chunk + 12) != CRF_CQDB_BYTEORDER)
+		return FALSE;
+	chunk_size = CrfReadUint32(chunk + 4);
+	backward_size = CrfReadUint32(chunk + 16);
+	backward_offset = CrfReadUint32(chunk + 20);
+	if (arg_offset + chunk_size > arg_buffer.size() || backward_offset + backward_size * 4 > chunk_size || backward_size < arg_count)
+		return FALSE;
+
+	arg_keys.assign(arg_count, std::string());
+	for (i = 0; i < arg_count; ++i) {
+		record_offset = CrfReadUint32(chunk + backward_offset + i * 4);
+		if (!record_offset)
+			continue;
+		if (record_offset + 8 > chunk_size)
+			return FALSE;
+		record = chunk + record_offset;
+		key_size = CrfReadUint32(record + 4);
+		if (!key_size || record_offset + 8 + key_size > chunk_size)
+			return FALSE;
+		arg_keys[i].assign((const char*)record + 8, key_size - 1);
+	}
+	return TRUE;
+}
+
+// groups attributes by the name before '=', so features are looked up by value without building the whole name
+void CrfModelGroupAttributes(const std::vector<std::string> &arg_names, CRF_MODEL &arg_model) {
+	size_t i, j, separator;
+	int number;
+	std::unordered_map<std::string, int>::iterator it;
+
+	arg_model.group_ids.clear();
+	arg_model.groups.clear();
+	for (i = 0; i < arg_names.size(); ++i) {
+		const std::string &name = arg_names[i];
+		if ((separator = name.find('=')) == std::string::npos)
+			continue;
+		it = arg_model.group_ids.find(name.substr(0, separator));
+		if (it == arg_model.group_ids.end()) {
+			it = arg_model.group_ids.insert(std::make_pair(name.substr(0, separator), (int)arg_model.groups.size())).first;
+			arg_model.groups.push_back(CRF_ATTRIBUTE_GROUP());
+		}
+		CRF_ATTRIBUTE_GROUP &group = arg_model.groups[it->second];
+		group.values[name.substr(separator + 1)] = (int)i;
+
+		// small decimal numbers without leading zeros are indexed directly
+		for (j = separator + 1, number = 0; j < name.size() && isdigit((unsigned char)name[j]) && number < CRF_GROUP_NUMBERS_MAX; ++j)
+			number = number * 10 + (name[j] - '0');
+		if (j == name.size() && j > separator + 1 && number < CRF_GROUP_NUMBERS_MAX && (name[separator + 1] != '0' || j == separator + 2)) {
+			if (group.numbers.size() <= (size_t)number)
+				group.numbers.resize(number + 1, -1);
+			group.numbers[number] = (int)i;
+		}
+	}
+}
+
+// loads CRFsuite model file; exits on error same as FileLoad
+void CrfModelLoad(const char *arg_filename, CRF_MODEL &arg_model) {
+	FILE *file;
+	std::vector<unsigned char> buffer;
+	std::vector<std::string> attribute_names;
+	const unsigned char *header, *feature;
+	size_t i, features_count, features_offset, file_size;
+	unsigned int type, src, dst;
+	int L;
+
+	if ((file = fopen(arg_filename, "rb")) == NULL) {
+		fprintf(stderr, "Error: Unable to open model %s\n", arg_filename);
+		DirectoryDeleteSys("~temp");
+		exit(EXIT_ERROR_FOPEN);
+	}
+	FSEEK64(file, 0, SEEK_END);
+	file_size = (size_t)FTELL64(file);
+	rewind(file);
+	buffer.resize(file_size);
+	if (file_size < CRF_HEADER_SIZE || fread(&buffer[0], 1, file_size, file) != file_size) {
+		fprintf(stderr, "Error: Unable to load model %s\n", arg_filename);
+		fclose(file);
+		DirectoryDeleteSys("~temp");
+		exit(EXIT_ERROR_READ);
+	}
+	fclose(file);
+
+	header = &buffer[0];
+	if (memcmp(header, CRF_FILEMAGIC, 4) != 0 || CrfReadUint32(header + 4) > file_size) {
+		fprintf(stderr, "Error: %s is not a CRFsuite model\n", arg_filename);
+		DirectoryDeleteSys("~temp");
+		exit(EXIT_ERROR_READ);
+	}
+	features_count = CrfReadUint32(header + 16);
+	arg_model.labels_count = L = (int)CrfReadUint32(header + 20);
+	arg_model.attributes_count = (int)CrfReadUint32(header + 24);
+	features_offset = CrfReadUint32(header + 28) + CRF_CHUNK_SIZE;
+
+	if (features_offset + features_count * CRF_FEATURE_SIZE > file_size
+		|| !CrfReadCqdb(buffer, CrfReadUint32(header + 32), L, arg_model.labels)
+		|| !CrfReadCqdb(buffer, CrfReadUint32(header + 36), arg_model.attributes_count, attribute_names)) {
+		fprintf(stderr, "Error: Model %s is corrupted\n", arg_filename);
+		DirectoryDeleteSys("~temp");
+		exit(EXIT_ERROR_READ);
+	}
+
+	arg_model.attributes.clear();
+	arg_model.attributes.reserve(attribute_names.size());
+	for (i = 0; i < attribute_names.size(); ++i) {
+		if (!attribute_names[i].empty())
+			arg_model.attributes[attribute_names[i]] = (int)i;
+	}
+	CrfModelGroupAttributes(attribute_names, arg_model);
+
+	// state features grouped by attribute (counting sort keeps the order of the file), transitions as matrix
+	arg_model.state_begin.assign(arg_model.attributes_count + 1, 0);
+	arg_model.transition.assign((size_t)L * L, 0.0);
+	for (i = 0; i < features_count; ++i) {
+		feature = header + features_offset + i * CRF_FEATURE_SIZE;
+		if (CrfReadUint32(feature) == CRF_FEATURE_STATE && CrfReadUint32(feature + 4) < (unsigned int)arg_model.attributes_count && CrfReadUint32(feature + 8) < (unsigned int)L)
+			++arg_model.state_begin[CrfReadUint32(feature + 4) + 1];
+	}
+	for (i = 1; i < arg_model.state_begin.size(); ++i)
+		arg_model.state_begin[i] += arg_model.state_begin[i - 1];
+	arg_model.state_label.resize(arg_model.state_begin.back());
+	arg_model.state_weight.resize(arg_model.state_begin.back());
+	std::vector<size_t> fill(arg_model.state_begin.begin(), arg_model.state_begin.end() - 1);
+	for (i = 0; i < features_count; ++i) {
+		feature = header + features_offset + i * CRF_FEATURE_SIZE;
+		type = CrfReadUint32(feature);
+		src = CrfReadUint32(feature + 4);
+		dst = CrfReadUint32(feature + 8);
+		if (dst >= (unsigned int)L)
+			continue;
+		if (type == CRF_FEATURE_STATE && src < (unsigned int)arg_model.attributes_count) {
+			arg_model.state_label[fill[src]] = (int)dst;
+			arg_model.state_weight[fill[src]] = CrfReadDouble(feature + 12);
+			++fill[src];
+		}
+		else if (type == CRF_FEATURE_TRANSITION && src < (unsigned int)L) {
+			arg_model.transition[(size_t)src * L + dst] = CrfReadDouble(feature + 12);
+		}
+	}
+}
+
+// decodes escapes of the CRFsuite data format (\: and \\) in place, other backslashes are kept as they are
+std::string& CrfUnescapeAlter(std::string &arg_name) {
+	size_t i, j;
+	for (i = j = 0; i < arg_name.size(); ++i, ++j) {
+		if (arg_name[i] == '\\' && i + 1 < arg_name.size() && (arg_name[i + 1] == ':' || arg_name[i + 1] == '\\'))
+			++i;
+		arg_name[j] = arg_name[i];
+	}
+	arg_name.resize(j);
+	return arg_name;
+}
+
+std::string CrfUnescape(const std::string &arg_name) {
+	std::string name = arg_name;
+	return CrfUnescapeAlter(name);
+}
+
+// returns attribute id or -1 when the model does not know the attribute
+inline int CrfAttributeId(const CRF_MODEL &arg_model, const std::string &arg_name) {
+	std::unordered_map<std::string, int>::const_iterator it = arg_model.attributes.find(arg_name);
+	return it == arg_model.attributes.end() ? -1 : it->second;
+}
+
+// returns group id or -1 when no attribute of the model has the name
+inline int CrfGroupId(const CRF_MODEL &arg_model, const std::string &arg_name) {
+	std::unordered_map<std::string, int>::const_iterator it = arg_model.group_ids.find(arg_name);
+	return it == arg_model.group_ids.end() ? -1 : it->second;
+}
+
+// returns id of attribute "name=value" of the group, or -1
+inline int CrfGroupValueId(const CRF_MODEL &arg_model, int arg_group, const std::string &arg_value) {
+	if (arg_group < 0)
+		return -1;
+	const CRF_ATTRIBUTE_GROUP &group = arg_model.groups[arg_group];
+	std::unordered_map<std::string, int>::const_iterator it = group.values.find(arg_value);
+	return it == group.values.end() ? -1 : it->second;
+}
+
+// same as CrfGroupValueId for value written as decimal number
+inline int CrfGroupNumberId(const CRF_MODEL &arg_model, int arg_group, LONG arg_value) {
+	if (arg_group < 0)
+		return -1;
+	const CRF_ATTRIBUTE_GROUP &group = arg_model.groups[arg_group];
+	if (arg_value >= 0 && arg_value < CRF_GROUP_NUMBERS_MAX)
+		return (size_t)arg_value < group.numbers.size() ? group.numbers[(size_t)arg_value] : -1;
+	return CrfGroupValueId(arg_model, arg_group, std::to_string(arg_value));
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////  INSTANCE
+
+inline void CrfInstanceClear(CRF_INSTANCE &arg_instance) {
+	arg_instance.attributes.clear();
+	arg_instance.item_begin.clear();
+}
+
+inline void CrfInstanceAddItem(CRF_INSTANCE &arg_instance) {
+	arg_instance.item_begin.push_back(arg_instance.attributes.size());
+}
+
+// unknown attributes are dropped here, they would not contribute to any score
+inline void CrfInstanceAddAttribute(CRF_INSTANCE &arg_instance, int arg_attribute_id) {
+	if (arg_attribute_id >= 0)
+		arg_instance.attributes.push_back(arg_attribute_id);
+}
+
+inline size_t CrfInstanceLength(const CRF_INSTANCE &arg_instance) {
+	return arg_instance.item_begin.size();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////  DECODE
+
+// finds the most probable label sequence; ties are resolved to the lower label id as in CRFsuite
+void CrfViterbi(const CRF_MODEL &arg_model, const CRF_INSTANCE &arg_instance, std::vector<int> &arg_labels) {
+	size_t T = CrfInstanceLength(arg_instance), L = arg_model.labels_count, t, i, j, a, end;
+	std::vector<double> score, alpha;
+	std::vector<int> back;
+	double max_score, value;
+	int argmax;
+
+	arg_labels.assign(T, 0);
+	if (!T || !L)
+		return;
+	score.assign(T * L, 0.0);
+	alpha.resize(T * L);
+	back.assign(T * L, 0);
+
+	// state scores
+	for (t = 0; t < T; ++t) {
+		end = (t + 1 < T) ? arg_instance.item_begin[t + 1] : arg_instance.attributes.size();
+		for (a = arg_instance.item_begin[t]; a < end; ++a) {
+			int attribute = arg_instance.attributes[a];
+			for (i = arg_model.state_begin[attribute]; i < arg_model.state_begin[attribute + 1]; ++i)
+				score[t * L + arg_model.state_label[i]] += arg_model.state_weight[i];
+		}
+	}
+
+	// forward pass
+	for (j = 0; j < L; ++j)
+		alpha[j] = score[j];
+	for (t = 1; t < T; ++t) {
+		for (j = 0; j < L; ++j) {
+			max_score = -DBL_MAX;
+			argmax = -1;
+			for (i = 0; i < L; ++i) {
+				value = alpha[(t - 1) * L + i] + arg_model.transition[i * L + j];
+				if (max_score < value) {
+					max_score = value;
+					argmax = (int)i;
+				}
+			}
+			if (argmax >= 0)
+				back[t * L + j] = argmax;
+			alpha[t * L + j] = max_score + score[t * L + j];
+		}
+	}
+
+	// backtrack from the best last label
+	max_score = -DBL_MAX;
+	for (i = 0; i < L; ++i) {
+		if (max_score < alpha[(T - 1) * L + i]) {
+			max_score = alpha[(T - 1) * L + i];
+			arg_labels[T - 1] = (int)i;
+		}
+	}
+	for (t = T - 1; t > 0; --t)
+		arg_labels[t - 1] = back[t * L + arg_labels[t]];
+}
+
+#endif
@@ -14,25 +14,54 @@
 #include <locale.h>
 #include <time.h>
 #include <algorithm>
+#include <string>
+#include <locale>
 #include <codecvt>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////  OS SPECIFIC
 
 #ifdef _WIN32
 
+// must precede the BOOL macro below
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+
 #define POPEN _popen
 #define WPOPEN _wpopen
 #define PCLOSE _pclose
 #define FSEEK64 _fseeki64
 #define FTELL64 _ftelli64
+#define PATH_LIST_SEPARATOR ";"
+#define SET_BINARY_MODE(file) _setmode(_fileno(file), _O_BINARY)
+#define SET_UTF8_MODE(file) _setmode(_fileno(file), _O_U8TEXT)
 
 #else
 
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
 #define POPEN popen
 #define WPOPEN wpopen
 #define PCLOSE pclose
 #define FSEEK64 fseeko64
 #define FTELL64 ftello64
+#define PATH_LIST_SEPARATOR ":"
+#define SET_BINARY_MODE(file)
+#define SET_UTF8_MODE(file)
 
 #endif
 
@@ -51,6 +80,7 @@
 #define KB 1024
 #define MB 1048576
 #define GB 1073741824
+#define FRAME_SIZE_MAX GB
 #define BOM 65279
 #define FOPEN_MODE_WRITE_UTF8 "wtS, ccs=UTF-8"
 #define FOPEN_MODE_WRITE_UTF8_W L"wtS, ccs=UTF-8"
@@ -230,6 +260,102 @@ std::wstring StringRemoveDiacritics(std::wstring& arg_string, size_t arg_start =
 	return retrn;
 }
 
+// invalid characters are replaced by '?'; encoded by hand into the buffer of arg_result, it runs for every token
+std::string& StringToUtf8Alter(const wchar_t* arg_string, size_t arg_length, std::string& arg_result) {
+	std::string &retrn = arg_result;
+	size_t i;
+	unsigned long c, next;
+	retrn.clear();
+	for (i = 0; i < arg_length; ++i) {
+		c = (unsigned long)arg_string[i];
+		next = (i + 1 < arg_length) ? (unsigned long)arg_string[i + 1] : 0;
+		// surrogate pair, wchar_t has 16 bits on windows
+		if (c >= 0xD800 && c < 0xDC00 && next >= 0xDC00 && next < 0xE000) {
+			c = 0x10000 + ((c - 0xD800) << 10) + (next - 0xDC00);
+			++i;
+		}
+		else if ((c >= 0xD800 && c < 0xE000) || c > 0x10FFFF)
+			c = '?';
+		if (c < 0x80)
+			retrn += (char)c;
+		else if (c < 0x800) {
+			retrn += (char)(0xC0 | (c >> 6));
+			retrn += (char)(0x80 | (c & 0x3F));
+		}
+		else if (c < 0x10000) {
+			retrn += (char)(0xE0 | (c >> 12));
+			retrn += (char)(0x80 | ((c >> 6) & 0x3F));
+			retrn += (char)(0x80 | (c & 0x3F));
+		}
+		else {
+			retrn += (char)(0xF0 | (c >> 18));
+			retrn += (char)(0x80 | ((c >> 12) & 0x3F));
+			retrn += (char)(0x80 | ((c >> 6) & 0x3F));
+			retrn += (char)(0x80 | (c & 0x3F));
+		}
+	}
+	return retrn;
+}
+
+std::string StringToUtf8(const std::wstring& arg_string) {
+	std::string retrn;
+	retrn.reserve(arg_string.size());
+	return StringToUtf8Alter(arg_string.c_str(), arg_string.size(), retrn);
+}
+
+// every malformed sequence is replaced by one '?', the rest of the string is kept; characters outside
+// the BMP become surrogate pairs where wchar_t has 16 bits (windows)
+std::wstring StringFromUtf8(const std::string& arg_string) {
+	std::wstring retrn;
+	size_t i, j, length, valid, size = arg_string.size();
+	unsigned long c, next, low, high;
+	retrn.reserve(size);
+	for (i = 0; i < size; i += valid) {
+		c = (unsigned char)arg_string[i];
+		valid = 1;
+		if (c < 0x80) {
+			retrn += (wchar_t)c;
+			continue;
+		}
+		// length of the sequence and the range of its second byte, which excludes overlong forms,
+		// surrogates and code points above 0x10FFFF
+		low = 0x80; high = 0xBF;
+		if (c >= 0xC2 && c <= 0xDF) length = 2;
+		else if (c >= 0xE0 && c <= 0xEF) {
+			length = 3;
+			if (c == 0xE0) low = 0xA0;
+			else if (c == 0xED) high = 0x9F;
+		}
+		else if (c >= 0xF0 && c <= 0xF4) {
+			length = 4;
+			if (c == 0xF0) low = 0x90;
+			else if (c == 0xF4) high = 0x8F;
+		}
+		else {
+			retrn += L'?';
+			continue;
+		}
+		c &= (0xFF >> (length + 1));
+		for (j = 1; j < length && i + j < size; ++j) {
+			next = (unsigned char)arg_string[i + j];
+			if (next < (j == 1 ? low : 0x80) || next > (j == 1 ? high : 0xBF))
+				break;
+			c = (c << 6) | (next & 0x3F);
+		}
+		// a cut sequence is skipped up to the first byte that does not continue it
+		valid = j;
+		if (j < length)
+			retrn += L'?';
+		else if (c >= 0x10000 && sizeof(wchar_t) == 2) {
+			retrn += (wchar_t)(0xD800 + ((c - 0x10000) >> 10));
+			retrn += (wchar_t)(0xDC00 + ((c - 0x10000) & 0x3FF));
+		}
+		else
+			retrn += (wchar_t)c;
+	}
+	return retrn;
+}
+
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////  DIRECTORY
 
@@ -417,4 +543,332 @@ std::wstring Execute(const wchar_t * arg_cmd) {
 	return ret;
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////  COPROCESS
+
+// long-running child process connected by pipes to its standard input and output
+typedef struct coprocess {
+#ifdef _WIN32
+	HANDLE process;
+#else
+	pid_t pid;
+#endif
+	FILE *in;		// writes to the standard input of the child
+	FILE *out;		// reads from the standard output of the child
+}COPROCESS;
+
+BOOL CoprocessOpen(const char * arg_cmd, COPROCESS &arg_process) {
+	arg_process.in = arg_process.out = NULL;
+#ifdef _WIN32
+	SECURITY_ATTRIBUTES security = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+	STARTUPINFOA startup;
+	PROCESS_INFORMATION info;
+	HANDLE child_in_read, child_in_write, child_out_read, child_out_write;
+	std::string command = arg_cmd;
+
+	if (!CreatePipe(&child_in_read, &child_in_write, &security, 0))
+		return FALSE;
+	if (!CreatePipe(&child_out_read, &child_out_write, &security, 0)) {
+		CloseHandle(child_in_read);
+		CloseHandle(child_in_write);
+		return FALSE;
+	}
+	// our ends of the pipes must not be inherited, otherwise the child never sees end of input
+	SetHandleInformation(child_in_write, HANDLE_FLAG_INHERIT, 0);
+	SetHandleInformation(child_out_read, HANDLE_FLAG_INHERIT, 0);
+
+	ZeroMemory(&startup, sizeof(startup));
+	startup.cb = sizeof(startup);
+	startup.dwFlags = STARTF_USESTDHANDLES;
+	startup.hStdInput = child_in_read;
+	startup.hStdOutput = child_out_write;
+	startup.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+	if (!CreateProcessA(NULL, &command[0], NULL, NULL, TRUE, CREATE_NO_WINDOW, NULL, NULL, &startup, &info)) {
+		CloseHandle(child_in_read);
+		CloseHandle(child_in_write);
+		CloseHandle(child_out_read);
+		CloseHandle(child_out_write);
+		return FALSE;
+	}
+	CloseHandle(info.hThread);
+	CloseHandle(child_in_read);
+	CloseHandle(child_out_write);
+	arg_process.process = info.hProcess;
+	arg_process.in = _fdopen(_open_osfhandle((intptr_t)child_in_write, _O_WRONLY | _O_BINARY), "wb");
+	arg_process.out = _fdopen(_open_osfhandle((intptr_t)child_out_read, _O_RDONLY | _O_BINARY), "rb");
+#else
+	int child_in[2], child_out[2];
+
+	if (pipe(child_in) != 0)
+		return FALSE;
+	if (pipe(child_out) != 0) {
+		close(child_in[0]);
+		close(child_in[1]);
+		return FALSE;
+	}
+	if ((arg_process.pid = fork()) < 0) {
+		close(child_in[0]);
+		close(child_in[1]);
+		close(child_out[0]);
+		close(child_out[1]);
+		return FALSE;
+	}
+	if (arg_process.pid == 0) {
+		dup2(child_in[0], STDIN_FILENO);
+		dup2(child_out[1], STDOUT_FILENO);
+		close(child_in[0]);
+		close(child_in[1]);
+		close(child_out[0]);
+		close(child_out[1]);
+		execl("/bin/sh", "sh", "-c", arg_cmd, (char*)NULL);
+		_exit(127);
+	}
+	// a dead child must not kill us while we write to it
+	signal(SIGPIPE, SIG_IGN);
+	close(child_in[0]);
+	close(child_out[1]);
+	arg_process.in = fdopen(child_in[1], "wb");
+	arg_process.out = fdopen(child_out[0], "rb");
+#endif
+	return arg_process.in != NULL && arg_process.out != NULL;
+}
+
+// closes the pipes, the child ends after reading end of input
+void CoprocessClose(COPROCESS &arg_process) {
+	if (arg_process.in)
+		fclose(arg_process.in);
+	if (arg_process.out)
+		fclose(arg_process.out);
+	arg_process.in = arg_process.out = NULL;
+#ifdef _WIN32
+	WaitForSingleObject(arg_process.process, INFINITE);
+	CloseHandle(arg_process.process);
+#else
+	waitpid(arg_process.pid, NULL, 0);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////  FRAMES
+
+// message is sent as its length in bytes on a separate line followed by the bytes themselves
+BOOL FrameWrite(FILE * arg_file, const std::string& arg_data) {
+	if (fprintf(arg_file, "%llu\n", (ULONG)arg_data.size()) < 0)
+		return FALSE;
+	if (fwrite(arg_data.data(), sizeof(char), arg_data.size(), arg_file) != arg_data.size())
+		return FALSE;
+	return fflush(arg_file) == 0;
+}
+
+// returns FALSE at the end of stream or on malformed frame
+BOOL FrameRead(FILE * arg_file, std::string& arg_data) {
+	char header[32];
+	char *end;
+	ULONG size;
+	if (fgets(header, sizeof(header), arg_file) == NULL)
+		return FALSE;
+	size = strtoull(header, &end, 10);
+	if (end == header || (*end != '\n' && *end != '\r') || size > FRAME_SIZE_MAX)
+		return FALSE;
+	arg_data.resize(size);
+	return size == 0 || fread(&arg_data[0], sizeof(char), size, arg_file) == size;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////  SOCKET
+
+#ifndef _WIN32
+// creates listening unix domain socket at the path, an old socket file is replaced; returns -1 on error
+int SocketListenLocal(const char * arg_path) {
+	int server;
+	struct sockaddr_un address;
+
+	if (strlen(arg_path) >= sizeof(address.sun_path))
+		return -1;
+	if ((server = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, arg_path);
+	unlink(arg_path);
+	if (bind(server, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(server, SOMAXCONN) != 0) {
+		close(server);
+		return -1;
+	}
+	// a client closing its connection early must not kill us while we write to it
+	signal(SIGPIPE, SIG_IGN);
+	return server;
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////  ARENA
+
+#define ARENA_BLOCK_SIZE (4 * MB)
+#define ARENA_ALIGNMENT 16
+
+// allocations released all at once; blocks are kept and reused after reset
+typedef struct arena {
+	std::vector<char*> blocks;
+	std::vector<size_t> sizes;
+	size_t block = 0;						// block being filled
+	size_t used = 0;						// bytes used in that block
+}ARENA;
+
+void* ArenaAlloc(ARENA &arg_arena, size_t arg_size) {
+	char *block;
+	arg_size = (arg_size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+	while (arg_arena.block < arg_arena.blocks.size() && arg_arena.used + arg_size > arg_arena.sizes[arg_arena.block]) {
+		++arg_arena.block;
+		arg_arena.used = 0;
+	}
+	if (arg_arena.block == arg_arena.blocks.size()) {
+		if ((block = (char*)malloc(MAX(arg_size, (size_t)ARENA_BLOCK_SIZE))) == NULL) {
+			fprintf(stderr, "Error: Unable to allocate %.2f MB\n", CONVERT_MB(MAX(arg_size, (size_t)ARENA_BLOCK_SIZE)));
+			DirectoryDeleteSys("~temp");
+			exit(EXIT_ERROR_MALLOC);
+		}
+		arg_arena.blocks.push_back(block);
+		arg_arena.sizes.push_back(MAX(arg_size, (size_t)ARENA_BLOCK_SIZE));
+		arg_arena.used = 0;
+	}
+	block = arg_arena.blocks[arg_arena.block] + arg_arena.used;
+	arg_arena.used += arg_size;
+	return block;
+}
+
+template <typename anyType>
+inline anyType* ArenaArray(ARENA &arg_arena, size_t arg_count) {
+	return (anyType*)ArenaAlloc(arg_arena, arg_count * sizeof(anyType));
+}
+
+// releases all allocations at once, memory stays reserved for the next use
+inline void ArenaReset(ARENA &arg_arena) {
+	arg_arena.block = arg_arena.used = 0;
+}
+
+void ArenaFree(ARENA &arg_arena) {
+	size_t i;
+	for (i = 0; i < arg_arena.blocks.size(); ++i)
+		free(arg_arena.blocks[i]);
+	arg_arena.blocks.clear();
+	arg_arena.sizes.clear();
+	ArenaReset(arg_arena);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////  THREAD POOL
+
+// tasks of one worker; the owner takes from the back, idle workers steal from the front
+typedef struct work_queue {
+	std::mutex lock;
+	std::deque<std::function<void()>> tasks;
+}WORK_QUEUE;
+
+typedef struct thread_pool {
+	std::vector<std::thread> threads;
+	std::deque<WORK_QUEUE> queues;			// one per worker, deque keeps mutexes in place
+	std::mutex lock;
+	std::condition_variable wake;			// signals new tasks or stop
+	std::condition_variable done;			// signals that no task is pending
+	std::atomic<size_t> queued;				// tasks waiting in queues
+	size_t pending;							// tasks not finished yet, guarded by lock
+	size_t next;							// queue for the next submitted task
+	BOOL stop;
+}THREAD_POOL;
+
+// takes own newest task, or steals the oldest task of another worker
+BOOL ThreadPoolTake(THREAD_POOL &arg_pool, size_t arg_worker, std::function<void()> &arg_task) {
+	size_t i, count = arg_pool.queues.size();
+	for (i = 0; i < count; ++i) {
+		WORK_QUEUE &queue = arg_pool.queues[(arg_worker + i) % count];
+		std::lock_guard<std::mutex> guard(queue.lock);
+		if (queue.tasks.empty())
+			continue;
+		if (i == 0) {
+			arg_task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		}
+		else {
+			arg_task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+		--arg_pool.queued;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+void ThreadPoolWork(THREAD_POOL *arg_pool, size_t arg_worker) {
+	std::function<void()> task;
+	for (;;) {
+		if (ThreadPoolTake(*arg_pool, arg_worker, task)) {
+			task();
+			std::lock_guard<std::mutex> guard(arg_pool->lock);
+			if (--arg_pool->pending == 0)
+				arg_pool->done.notify_all();
+			continue;
+		}
+		std::unique_lock<std::mutex> guard(arg_pool->lock);
+		while (!arg_pool->stop && arg_pool->queued == 0)
+			arg_pool->wake.wait(guard);
+		if (arg_pool->stop)
+			return;
+	}
+}
+
+// starts arg_count workers, with 0 workers tasks run in the calling thread
+void ThreadPoolStart(THREAD_POOL &arg_pool, size_t arg_count) {
+	size_t i;
+	arg_pool.queued = 0;
+	arg_pool.pending = arg_pool.next = 0;
+	arg_pool.stop = FALSE;
+	arg_pool.queues.resize(arg_count);
+	for (i = 0; i < arg_count; ++i)
+		arg_pool.threads.push_back(std::thread(ThreadPoolWork, &arg_pool, i));
+}
+
+void ThreadPoolSubmit(THREAD_POOL &arg_pool, std::function<void()> arg_task) {
+	if (arg_pool.threads.empty()) {
+		arg_task();
+		return;
+	}
+	WORK_QUEUE &queue = arg_pool.queues[arg_pool.next++ % arg_pool.queues.size()];
+	// counted as pending before any worker can finish it
+	{
+		std::lock_guard<std::mutex> guard(arg_pool.lock);
+		++arg_pool.pending;
+	}
+	{
+		std::lock_guard<std::mutex> guard(queue.lock);
+		queue.tasks.push_back(std::move(arg_task));
+	}
+	std::lock_guard<std::mutex> guard(arg_pool.lock);
+	++arg_pool.queued;
+	arg_pool.wake.notify_one();
+}
+
+// waits until all submitted tasks are finished
+void ThreadPoolWait(THREAD_POOL &arg_pool) {
+	std::unique_lock<std::mutex> guard(arg_pool.lock);
+	while (arg_pool.pending)
+		arg_pool.done.wait(guard);
+}
+
+// runs arg_function(i) for every i < arg_count and waits for all of them
+void ThreadPoolFor(THREAD_POOL &arg_pool, size_t arg_count, const std::function<void(size_t)> &arg_function) {
+	size_t i;
+	for (i = 0; i < arg_count; ++i)
+		ThreadPoolSubmit(arg_pool, [&arg_function, i]() { arg_function(i); });
+	ThreadPoolWait(arg_pool);
+}
+
+void ThreadPoolStop(THREAD_POOL &arg_pool) {
+	size_t i;
+	{
+		std::lock_guard<std::mutex> guard(arg_pool.lock);
+		arg_pool.stop = TRUE;
+		arg_pool.wake.notify_all();
+	}
+	for (i = 0; i < arg_pool.threads.size(); ++i)
+		arg_pool.threads[i].join();
+	arg_pool.threads.clear();
+	arg_pool.queues.clear();
+}
+
 #endif
\ No newline at end of file
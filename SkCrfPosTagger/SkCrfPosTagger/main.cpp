@@ -13,21 +13,64 @@
 // custom header file containing functions for std::(w)string manipulation, etc.
 #include "denralib.h"
 
-// objekt sluziaci na uchovanie slova a jeho crt v podobe tokenu
-typedef struct token {
-	std::wstring word;					// origin word
-	std::wstring word_lowercase;		// lowercase word
+// in-process CRFsuite model reader and decoder
+#include "crflib.h"
+
+// native tokenizer and sentence splitter
+#include "tokenlib.h"
+
+// tokenizers
+#define TOKENIZER_STANFORD	0
+#define TOKENIZER_NATIVE	1
+#define TOKENIZER_COPROCESS	2
+
+// features: w, f0-f6, prefixes f7-f10 and suffixes f11-f14, then v for every nearest neighbour;
+// only offsets -2, -1 and 0 are used, the models were trained without +1 and +2
+#define FEATURE_TEMPLATES	16
+#define FEATURE_VECTORS		20
+#define FEATURE_OFFSETS		3
+#define FEATURE_COUNT		(FEATURE_TEMPLATES + FEATURE_VECTORS)
+
+// streaming mode; memory needed per character of input window (text, tokens, features and output)
+#define STREAM_BYTES_PER_CHAR	256
+#define KNN_CACHE_SIZE_DEFAULT	256
+#define KNN_CACHE_WORDS_DEFAULT	65536
+#define KNN_RECALL_QUERIES	1000
+#define STREAM_MEMORY_DEFAULT	64
+
+// tokens of one document stored as parallel arrays; words are views into the tokenized text,
+// arrays come from the document arena and are released all at once
+typedef struct token_store {
+	size_t count;
+	const wchar_t *text;				// tokenized text, one token per line
+	size_t *word_begin;					// offset of the word in text
+	size_t *word_length;				// 0 for the empty line between sentences
+	size_t *sentence_position;			// position of the word in sentence
+	int *word_id;						// id of the word in vector vocabulary or -1, if we use them
+	int *vector;						// FEATURE_VECTORS nearest words per token, if we use them
+	BOOL vector_filled;					// vector was filled for all tokens before their features
+	int *attribute;						// model attribute ids per token, feature and offset -2..0
+}TOKEN_STORE;
+
+// objekt sluziaci na uchovanie tvaru slova
+typedef struct token_shape {
 	BOOL is_first_upper;				// if first letter is capital
 	BOOL is_full_upper;					// if the word is in uppercase
 	BOOL is_semi_upper;					// if the word contains other capital letter
 	BOOL contains_punct;				// if the word contains symbols
 	BOOL contains_digit;				// if the word contains numbers
-	size_t word_length;					// word length
-	size_t sentence_position;			// position of the word in sentence
-	std::wstring prefix[4];				// preffix of the word 1-4
-	std::wstring suffix[4];				// suffix of the word 1-4
-	int *vector;						// pointer for array containing vector, if we use them
-}TOKEN;
+}TOKEN_SHAPE;
+
+// buffers of one thread reused for all its tokens
+typedef struct token_scratch {
+	std::wstring lowercase;
+	std::wstring stripped;
+	std::string ascii;
+	std::string value;
+	std::vector<float> vector;			// vector of the word and its nearest words for vlib.h
+	std::vector<int> nearest;
+	std::vector<float> distance;
+}TOKEN_SCRATCH;
 
 // global variables
 std::wstring gv_path_in = L"",
@@ -35,6 +78,43 @@ gv_path_out = L"";
 FILE *gv_file_out = NULL;
 BOOL gv_use_vector = FALSE,
 gv_use_mapping = FALSE;
+int gv_tokenizer = TOKENIZER_STANFORD;
+COPROCESS gv_tokenizer_process = { 0, NULL, NULL };
+CRF_MODEL gv_crf_model;
+ARENA gv_arena;
+int gv_feature_groups[FEATURE_TEMPLATES + 1][FEATURE_OFFSETS],	// attribute groups of the model, last one is v
+gv_attribute_bos,
+gv_attribute_eos;
+BOOL gv_server = FALSE,
+gv_stream = FALSE,
+gv_stdin = FALSE;
+size_t gv_stream_memory = STREAM_MEMORY_DEFAULT;
+std::string gv_socket_path = "";
+BOOL gv_vector_loaded = FALSE;
+std::string gv_vector_path = "vec-300sk.bin",
+gv_vector_convert = "",
+gv_neighbors_path = "",
+gv_neighbors_build = "",
+gv_knn_cache_path = "",
+gv_vp_tree_path = "",
+gv_vp_tree_build = "",
+gv_hnsw_path = "",
+gv_hnsw_build = "",
+gv_quantized_path = "",
+gv_quantize = "";
+int gv_quantize_type = VLIB_QUANTIZED_INT8;
+BOOL gv_sketch = FALSE,
+gv_knn_recall = FALSE;
+size_t gv_knn_cache_size = KNN_CACHE_SIZE_DEFAULT;
+int gv_knn_cache_words = KNN_CACHE_WORDS_DEFAULT;
+// vector file is mapped instead of read, optionally with huge pages and prefaulted
+BOOL gv_vector_map = FALSE,
+gv_vector_huge_pages = FALSE,
+gv_vector_prefault = FALSE,
+gv_vector_filter = FALSE;
+// workers tagging sentences in parallel, none with single thread
+size_t gv_threads = 1;
+THREAD_POOL gv_pool;
 
 // help message
 inline void PrintHelp(std::string &arg_program_name) {
@@ -45,6 +125,41 @@ inline void PrintHelp(std::string &arg_program_name) {
 		"  -o, --out\tvypise vystup do suboru, miesto konzoly\n"
 		"  -m, --map\tvypise slova a prisluchajuce znacky, miesto len znaciek\n"
 		"  -v, --vector\tpouzije sa vectorom trenovany model\n"
+		"  --vectors SUBOR\n\t\tsubor vektorov slov (predvolene vec-300sk.bin), aj v indexovanom formate\n"
+		"  --convert-vectors SUBOR\n\t\tzapise vektory do indexovaneho formatu SUBOR, ktory sa nacita okamzite\n"
+		"  --oov-filter\tbloom filter rychlo odmietne vacsinu slov mimo slovnika vektorov\n"
+		"  --mmap\tsubor vektorov sa namapuje do pamate, procesy zdielaju jednu kopiu\n"
+		"  --knn-cache SUBOR\n\t\tnajblizsie slova sa uchovaju v subore SUBOR pre dalsie spustenia\n"
+		"  --knn-cache-size MB\n\t\tmaximalna velkost suboru --knn-cache (predvolene 256)\n"
+		"  --knn-cache-words N\n\t\tpocet slov, ktorych najblizsie slova sa drzia v pamati (predvolene 65536)\n"
+		"  --build-neighbors SUBOR\n\t\tvypocita 20 najblizsich slov kazdeho slova slovnika do tabulky SUBOR\n"
+		"  --neighbors SUBOR\n\t\tnajblizsie slova z tabulky SUBOR, matica vektorov sa nenacita\n"
+		"  --build-vp-tree SUBOR\n\t\tpostavi vantage-point strom vektorov do suboru SUBOR\n"
+		"  --vp-tree SUBOR\n\t\tnajblizsie slova sa hladaju v strome zo suboru SUBOR\n"
+		"  --build-hnsw SUBOR\n\t\tpostavi HNSW graf vektorov do suboru SUBOR a vypise jeho recall@20\n"
+		"  --hnsw SUBOR\n\t\tnajblizsie slova sa hladaju priblizne v grafe zo suboru SUBOR\n"
+		"  --hnsw-ef N\tpocet kandidatov pri hladani v grafe (predvolene 64)\n"
+		"  --quantize-vectors SUBOR\n\t\tzapise vektory kvantovane na int8 do suboru SUBOR\n"
+		"  --quantize-fp16\t--quantize-vectors zapise vektory ako fp16\n"
+		"  --quantized SUBOR\n\t\tnajblizsie slova sa hladaju v kvantovanych vektoroch zo SUBORU (zahrna --mmap)\n"
+		"  --rerank N\tN*20 najlepsich kandidatov sa prepocita v fp32 (predvolene 4, 0 vypne)\n"
+		"  --sketch\tnajblizsie slova sa vyberaju podla 256-bitovych odtlackov vektorov a prepocitaju sa\n"
+		"  --sketch-candidates N\n\t\tpocet kandidatov z odtlackov (predvolene 400)\n"
+		"  --recall\tporovna zvolene hladanie s presnym a skonci\n"
+		"  --dot-test\tporovna SIMD implementacie skalarneho sucinu so skalarnou a skonci\n"
+		"  --tokenizer-test SUBOR\n\t\tporovna vstavany tokenizator s vystupom javy v SUBOR.tok a skonci,\n\t\tchybajuci SUBOR.tok vytvori TokenizerServer.class\n"
+		"  --huge-pages\tnamapuje vektory s velkymi strankami (ak ich system podporuje)\n"
+		"  --prefault\tnamapovane vektory nacita do pamate hned pri starte\n"
+		"  -t, --tokenizer NAZOV\n\t\ttokenizator: stanford (predvolene, java), coprocess (java bezi\n"
+		"\t\tpocas celeho behu, TokenizerServer.class) alebo native (vstavany)\n"
+		"  -s, --server\tmodely zostanu nacitane a kazda poziadavka zo standardneho vstupu\n"
+		"\t\t\"<dlzka v bajtoch>\\n<text v UTF-8>\" dostane odpoved v rovnakom tvare\n"
+		"  --socket CESTA\tserver prijima poziadavky na unix domain sockete CESTA (nie vo Windows)\n"
+		"  --stream\tspracuje vstupny subor (-f) po castiach celych viet, pamat nezavisi od jeho velkosti\n"
+		"  --memory MB\tpamat pre jednu cast textu pri --stream (predvolene 64)\n"
+		"  --threads N\tspracuje vety paralelne v N vlaknach, 0 pre vsetky jadra (predvolene 1)\n"
+		"  -i, --stdin\tcita text zo standardneho vstupu a vypise znacky kazdej vety hned, ako je\n"
+		"\t\tukoncena; prazdny riadok ukonci aj vetu bez interpunkcie (vhodne s -t coprocess)\n"
 		"  -h, --help\tzobrazi tuto pomoc");
 #else
 	printf("Usage: %s [OPTION...] INPUT\n", arg_program_name.c_str());
@@ -53,6 +168,42 @@ inline void PrintHelp(std::string &arg_program_name) {
 		"  -o, --out\toutputs processed text to file without messages\n"
 		"  -m, --map\toutputs word with pos tag, instead of only tag\n"
 		"  -v, --vector\tuse model trained with vectors\n"
+		"  --vectors FILE\tword vector file (default vec-300sk.bin), also in the indexed format\n"
+		"  --convert-vectors FILE\n\t\twrites the vectors in the indexed format FILE, which loads at once\n"
+		"  --oov-filter\tbloom filter rejects most words missing in the vector vocabulary early\n"
+		"  --mmap\tmaps the vector file into memory, processes share one copy of it\n"
+		"  --knn-cache FILE\n\t\tkeeps found nearest words in FILE for the next runs\n"
+		"  --knn-cache-size MB\n\t\tlimit of the --knn-cache file (default 256)\n"
+		"  --knn-cache-words N\n\t\tnumber of words with nearest words kept in memory (default 65536)\n"
+		"  --build-neighbors FILE\n\t\tcomputes the 20 nearest words of every vocabulary word into table FILE\n"
+		"  --neighbors FILE\n\t\tnearest words from table FILE, the vector matrix is not loaded\n"
+		"  --build-vp-tree FILE\n\t\tbuilds a vantage-point tree of the vectors into FILE\n"
+		"  --vp-tree FILE\n\t\tnearest words are searched in the tree from FILE\n"
+		"  --build-hnsw FILE\n\t\tbuilds a HNSW graph of the vectors into FILE and prints its recall@20\n"
+		"  --hnsw FILE\n\t\tnearest words are searched approximately in the graph from FILE\n"
+		"  --hnsw-ef N\tcandidates kept by the graph search (default 64)\n"
+		"  --quantize-vectors FILE\n\t\twrites the vectors quantized to int8 into FILE\n"
+		"  --quantize-fp16\t--quantize-vectors writes the vectors as fp16\n"
+		"  --quantized FILE\n\t\tnearest words are searched in the quantized vectors of FILE (implies --mmap)\n"
+		"  --rerank N\tthe best N*20 candidates are checked in fp32 (default 4, 0 disables)\n"
+		"  --sketch\tnearest words are shortlisted by 256-bit sketches of the vectors and checked\n"
+		"  --sketch-candidates N\n\t\tcandidates shortlisted by the sketches (default 400)\n"
+		"  --recall\tcompares the selected search with the exact one and exits\n"
+		"  --dot-test\tcompares SIMD dot product kernels with the scalar one and exits\n"
+		"  --tokenizer-test FILE\n\t\tcompares the native tokenizer with the java output in FILE.tok and exits,\n\t\ta missing FILE.tok is written by TokenizerServer.class\n"
+		"  --huge-pages\tmaps the vectors with huge pages (where the system supports them)\n"
+		"  --prefault\tloads the mapped vectors into memory at start\n"
+		"  -t, --tokenizer NAME\n\t\ttokenizer: stanford (default, java), coprocess (java kept running,\n"
+		"\t\tneeds TokenizerServer.class) or native (built-in)\n"
+		"  -s, --server\tkeeps models loaded and answers every request from standard input\n"
+		"\t\t\"<length in bytes>\\n<UTF-8 text>\" with response of the same form\n"
+		"  --socket PATH\tserver accepts requests on unix domain socket PATH (not on Windows)\n"
+		"  --stream\tprocesses input file (-f) in windows of whole sentences, memory does not\n"
+		"\t\tdepend on the file size\n"
+		"  --memory MB\tmemory for one window of text with --stream (default 64)\n"
+		"  --threads N\tprocesses sentences in parallel on N threads, 0 for all cores (default 1)\n"
+		"  -i, --stdin\treads text from standard input and prints tags of every sentence as soon as\n"
+		"\t\tit ends; empty line ends also a sentence without punctuation (use -t coprocess)\n"
 		"  -h, --help\tdisplay this help and exit");
 #endif
 }
@@ -104,6 +255,74 @@ inline void PrintTagsExplanation() {
 #endif
 }
 
+// writes the text for the java pipeline
+void SaveInput(const std::wstring &arg_text, const std::wstring &arg_path) {
+	FILE * file_in;
+
+	if ((file_in = _wfopen(arg_path.c_str(), FOPEN_MODE_WRITE_UTF8_W)) == NULL) {
+		DirectoryDeleteSys("~temp");
+		exit(EXIT_ERROR_FOPEN);
+	}
+	fwprintf(file_in, L"%s", arg_text.c_str());
+	fclose(file_in);
+}
+
+// sends the text to the java tokenizer running in background, which is started on first use
+void TokenizeCoprocess(const std::wstring &arg_text, std::wstring &arg_str) {
+	std::string response;
+	const char *classpath;
+
+	if (gv_tokenizer_process.in == NULL) {
+		classpath = getenv("CLASSPATH");
+		std::string command = std::string() + "java -cp \"" + (classpath ? classpath : "") + PATH_LIST_SEPARATOR + ".\" TokenizerServer";
+		if (!CoprocessOpen(command.c_str(), gv_tokenizer_process)) {
+			fprintf(stderr, "Error: Unable to execute %s\n", command.c_str());
+			exit(EXIT_ERROR_POPEN);
+		}
+	}
+	if (!FrameWrite(gv_tokenizer_process.in, StringToUtf8(arg_text)) || !FrameRead(gv_tokenizer_process.out, response)) {
+		fprintf(stderr, "Error: Tokenizer process ended unexpectedly\n");
+		exit(EXIT_ERROR_POPEN);
+	}
+	arg_str = StringFromUtf8(response);
+}
+
+// tokenizes the text file with the native tokenizer and compares it line by line with the output of the java
+// pipeline saved in the same file with extension .tok, returns the number of different lines; a missing .tok
+// file is written by the java tokenizer first
+int TokenizerTest(const std::wstring &arg_path) {
+	std::wstring text, expected, output;
+	std::vector<std::wstring> expected_lines, output_lines;
+	size_t i, start, end;
+	int differences = 0;
+	FILE *file;
+
+	FileLoad(arg_path.c_str(), FOPEN_MODE_READ_UTF8_W, text);
+	text.resize(wcslen(text.c_str()));
+	if ((file = _wfopen((arg_path + L".tok").c_str(), FOPEN_MODE_READ_UTF8_W)) == NULL) {
+		TokenizeCoprocess(text, expected);
+		SaveInput(expected, arg_path + L".tok");
+	}
+	else {
+		fclose(file);
+		FileLoad((arg_path + L".tok").c_str(), FOPEN_MODE_READ_UTF8_W, expected);
+		expected.resize(wcslen(expected.c_str()));
+	}
+	StringReplaceAllAlter(expected, L"\n*NL*\n", L"\n\n");
+	TokenizeText(text, output);
+	for (start = 0; (end = expected.find(L'\n', start)) != std::wstring::npos; start = end + 1)
+		expected_lines.push_back(expected.substr(start, end - start));
+	for (start = 0; (end = output.find(L'\n', start)) != std::wstring::npos; start = end + 1)
+		output_lines.push_back(output.substr(start, end - start));
+	for (i = 0; i < max(expected_lines.size(), output_lines.size()); ++i) {
+		const std::wstring &a = i < expected_lines.size() ? expected_lines[i] : L"<end>", &b = i < output_lines.size() ? output_lines[i] : L"<end>";
+		if (a != b && ++differences <= 20)
+			printf("line %d: expected \"%s\", native \"%s\"\n", (int)i + 1, StringToUtf8(a).c_str(), StringToUtf8(b).c_str());
+	}
+	printf("%d lines, %d differences\n", (int)expected_lines.size(), differences);
+	return differences;
+}
+
 // interprest the input, sets paths and raises flags
 void InterpretParameters(int &argc, char ** &argv) {
 	int arg_iter;
@@ -157,6 +376,257 @@ void InterpretParameters(int &argc, char ** &argv) {
 		else if (strcmp(argv[arg_iter], "-v") == 0 || strcmp(argv[arg_iter], "--vector") == 0) {
 			gv_use_vector = TRUE;
 		}
+		// map vector file instead of reading it
+		else if (strcmp(argv[arg_iter], "--mmap") == 0) {
+			gv_vector_map = TRUE;
+		}
+		else if (strcmp(argv[arg_iter], "--vectors") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc) {
+				fprintf(stderr, "Error: Missing vector file\n");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_vector_path = argv[arg_iter];
+		}
+		// only write the vectors in the indexed format
+		else if (strcmp(argv[arg_iter], "--convert-vectors") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc) {
+				fprintf(stderr, "Error: Missing output vector file\n");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_vector_convert = argv[arg_iter];
+		}
+		// reject unknown words before the vocabulary index
+		else if (strcmp(argv[arg_iter], "--oov-filter") == 0) {
+			gv_vector_filter = TRUE;
+		}
+		// nearest words from the precomputed table instead of searching them
+		else if (strcmp(argv[arg_iter], "--neighbors") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc) {
+				fprintf(stderr, "Error: Missing neighbour table file\n");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_neighbors_path = argv[arg_iter];
+		}
+		// keep found nearest words in a file for the next runs
+		else if (strcmp(argv[arg_iter], "--knn-cache") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc) {
+				fprintf(stderr, "Error: Missing cache file\n");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_knn_cache_path = argv[arg_iter];
+		}
+		else if (strcmp(argv[arg_iter], "--knn-cache-size") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc || atoi(argv[arg_iter]) <= 0) {
+				fprintf(stderr, "Error: Invalid cache size %s\n", arg_iter < argc ? argv[arg_iter] : "");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_knn_cache_size = atoi(argv[arg_iter]);
+		}
+		else if (strcmp(argv[arg_iter], "--knn-cache-words") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc || atoi(argv[arg_iter]) < 0) {
+				fprintf(stderr, "Error: Invalid cache size %s\n", arg_iter < argc ? argv[arg_iter] : "");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_knn_cache_words = atoi(argv[arg_iter]);
+		}
+		// only write the table of nearest words
+		else if (strcmp(argv[arg_iter], "--build-neighbors") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc) {
+				fprintf(stderr, "Error: Missing output neighbour table file\n");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_neighbors_build = argv[arg_iter];
+		}
+		// search nearest words in a vantage-point tree
+		else if (strcmp(argv[arg_iter], "--vp-tree") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc) {
+				fprintf(stderr, "Error: Missing vantage-point tree file\n");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_vp_tree_path = argv[arg_iter];
+		}
+		// only write the vantage-point tree
+		else if (strcmp(argv[arg_iter], "--build-vp-tree") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc) {
+				fprintf(stderr, "Error: Missing output vantage-point tree file\n");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_vp_tree_build = argv[arg_iter];
+		}
+		// search nearest words approximately in a HNSW graph
+		else if (strcmp(argv[arg_iter], "--hnsw") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc) {
+				fprintf(stderr, "Error: Missing HNSW graph file\n");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_hnsw_path = argv[arg_iter];
+		}
+		// only write the HNSW graph
+		else if (strcmp(argv[arg_iter], "--build-hnsw") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc) {
+				fprintf(stderr, "Error: Missing output HNSW graph file\n");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_hnsw_build = argv[arg_iter];
+		}
+		else if (strcmp(argv[arg_iter], "--hnsw-ef") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc || atoi(argv[arg_iter]) <= 0) {
+				fprintf(stderr, "Error: Invalid number of candidates %s\n", arg_iter < argc ? argv[arg_iter] : "");
+				exit(EXIT_ERROR_INPUT);
+			}
+			hnsw_ef = atoi(argv[arg_iter]);
+		}
+		// only write the quantized vectors
+		else if (strcmp(argv[arg_iter], "--quantize-vectors") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc) {
+				fprintf(stderr, "Error: Missing output quantized vector file\n");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_quantize = argv[arg_iter];
+		}
+		else if (strcmp(argv[arg_iter], "--quantize-fp16") == 0) {
+			gv_quantize_type = VLIB_QUANTIZED_FP16;
+		}
+		// scan the quantized vectors, the full ones are only mapped for the candidates
+		else if (strcmp(argv[arg_iter], "--quantized") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc) {
+				fprintf(stderr, "Error: Missing quantized vector file\n");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_quantized_path = argv[arg_iter];
+			gv_vector_map = TRUE;
+		}
+		else if (strcmp(argv[arg_iter], "--rerank") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc || atoi(argv[arg_iter]) < 0) {
+				fprintf(stderr, "Error: Invalid number of candidates %s\n", arg_iter < argc ? argv[arg_iter] : "");
+				exit(EXIT_ERROR_INPUT);
+			}
+			quantized_rerank = atoi(argv[arg_iter]);
+		}
+		// shortlist by binary sketches, rerank by dot()
+		else if (strcmp(argv[arg_iter], "--sketch") == 0) {
+			gv_sketch = TRUE;
+		}
+		else if (strcmp(argv[arg_iter], "--sketch-candidates") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc || atoi(argv[arg_iter]) <= 0) {
+				fprintf(stderr, "Error: Invalid number of candidates %s\n", arg_iter < argc ? argv[arg_iter] : "");
+				exit(EXIT_ERROR_INPUT);
+			}
+			sketch_candidates = atoi(argv[arg_iter]);
+		}
+		else if (strcmp(argv[arg_iter], "--recall") == 0) {
+			gv_knn_recall = TRUE;
+		}
+		else if (strcmp(argv[arg_iter], "--huge-pages") == 0) {
+			gv_vector_map = gv_vector_huge_pages = TRUE;
+		}
+		else if (strcmp(argv[arg_iter], "--prefault") == 0) {
+			gv_vector_map = gv_vector_prefault = TRUE;
+		}
+		// choose tokenizer
+		else if (strcmp(argv[arg_iter], "-t") == 0 || strcmp(argv[arg_iter], "--tokenizer") == 0) {
+			++arg_iter;
+			if (arg_iter < argc && strcmp(argv[arg_iter], "stanford") == 0)
+				gv_tokenizer = TOKENIZER_STANFORD;
+			else if (arg_iter < argc && strcmp(argv[arg_iter], "native") == 0)
+				gv_tokenizer = TOKENIZER_NATIVE;
+			else if (arg_iter < argc && strcmp(argv[arg_iter], "coprocess") == 0)
+				gv_tokenizer = TOKENIZER_COPROCESS;
+			else {
+				fprintf(stderr, "Error: Unknown tokenizer %s\n", arg_iter < argc ? argv[arg_iter] : "");
+				exit(EXIT_ERROR_INPUT);
+			}
+		}
+		// serve requests instead of single input
+		else if (strcmp(argv[arg_iter], "-s") == 0 || strcmp(argv[arg_iter], "--server") == 0) {
+			gv_server = TRUE;
+		}
+		else if (strcmp(argv[arg_iter], "--socket") == 0) {
+			++arg_iter;
+#ifdef _WIN32
+			fprintf(stderr, "Error: Unix domain sockets are not supported on this system\n");
+			exit(EXIT_ERROR_INPUT);
+#else
+			if (arg_iter >= argc) {
+				fprintf(stderr, "Error: Missing socket path\n");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_server = TRUE;
+			gv_socket_path = argv[arg_iter];
+#endif
+		}
+		// read, tag and write the input file in windows
+		else if (strcmp(argv[arg_iter], "--stream") == 0) {
+			gv_stream = TRUE;
+		}
+		// read standard input sentence by sentence
+		else if (strcmp(argv[arg_iter], "-i") == 0 || strcmp(argv[arg_iter], "--stdin") == 0) {
+			gv_stdin = TRUE;
+		}
+		// tag sentences in parallel
+		else if (strcmp(argv[arg_iter], "--threads") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc || atoi(argv[arg_iter]) < 0) {
+				fprintf(stderr, "Error: Invalid number of threads %s\n", arg_iter < argc ? argv[arg_iter] : "");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_threads = atoi(argv[arg_iter]);
+			if (gv_threads == 0)
+				gv_threads = MAX(std::thread::hardware_concurrency(), 1);
+		}
+		else if (strcmp(argv[arg_iter], "--memory") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc || atoi(argv[arg_iter]) <= 0) {
+				fprintf(stderr, "Error: Invalid memory size %s\n", arg_iter < argc ? argv[arg_iter] : "");
+				exit(EXIT_ERROR_INPUT);
+			}
+			gv_stream_memory = atoi(argv[arg_iter]);
+		}
+		// compare the native tokenizer with the saved output of the java pipeline
+		else if (strcmp(argv[arg_iter], "--tokenizer-test") == 0) {
+			++arg_iter;
+			if (arg_iter >= argc) {
+				fprintf(stderr, "Error: Missing tokenizer test file\n");
+				exit(EXIT_ERROR_INPUT);
+			}
+			buffer_ascii = argv[arg_iter];
+			exit(TokenizerTest(std::wstring(buffer_ascii.begin(), buffer_ascii.end())) ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+		// compare the dot product kernels with the scalar one
+		else if (strcmp(argv[arg_iter], "--dot-test") == 0) {
+			std::vector<dot_kernel_info> kernels = dot_kernels();
+			BOOL passed = TRUE;
+			for (size_t i = 0; i < kernels.size(); ++i) {
+				float diff = dot_self_test(kernels[i].kernel);
+				printf("%-8s %s (relative difference %g)%s\n", kernels[i].name, diff <= VLIB_DOT_TOLERANCE ? "ok" : "FAILED", diff,
+					kernels[i].kernel == dot_kernel ? ", used" : "");
+				passed = passed && diff <= VLIB_DOT_TOLERANCE;
+			}
+			std::vector<dot_quantized_kernel_info> quantized = dot_quantized_kernels();
+			for (size_t i = 0; i < quantized.size(); ++i) {
+				float diff = dot_quantized_self_test(quantized[i]);
+				printf("%-8s int8/fp16 %s (relative difference %g)%s\n", quantized[i].name, diff <= VLIB_DOT_TOLERANCE ? "ok" : "FAILED", diff,
+					quantized[i].i8 == dot_quantized_kernel.i8 ? ", used" : "");
+				passed = passed && diff <= VLIB_DOT_TOLERANCE;
+			}
+			exit(passed ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
 		// print help
 		else if (strcmp(argv[arg_iter], "-h") == 0 || strcmp(argv[arg_iter], "--help") == 0) {
 			wprintf(L"%S (C) Dalibor Meszaros\n\n", program_name.c_str());
@@ -172,7 +642,35 @@ void InterpretParameters(int &argc, char ** &argv) {
 			break;
 	}
 
-	if (gv_path_in.empty() && arg_iter + 1 == argc) // if last argument is text
+	if (!gv_vector_convert.empty() || !gv_neighbors_build.empty() || !gv_vp_tree_build.empty() || !gv_hnsw_build.empty() || gv_knn_recall || !gv_quantize.empty()) { // tools do not tag any text
+		if (arg_iter < argc || !gv_path_in.empty()) {
+			fprintf(stderr, "Error: Conversion of vectors does not accept input text or input file\n");
+			exit(EXIT_ERROR_INPUT);
+		}
+		return;
+	}
+	else if (gv_server) { // server reads the texts from requests
+		if (arg_iter < argc || !gv_path_in.empty() || !gv_path_out.empty()) {
+			fprintf(stderr, "Error: Server does not accept input text, input or output file\n");
+			exit(EXIT_ERROR_INPUT);
+		}
+		return;
+	}
+	else if (gv_stdin) { // text comes only from standard input
+		if (arg_iter < argc || !gv_path_in.empty()) {
+			fprintf(stderr, "Error: Standard input mode does not accept input text or input file\n");
+			exit(EXIT_ERROR_INPUT);
+		}
+		return;
+	}
+	else if (gv_stream) { // streaming reads only the input file
+		if (arg_iter < argc || gv_path_in.empty()) {
+			fprintf(stderr, "Error: Streaming needs input file (-f) and no input text\n");
+			exit(EXIT_ERROR_INPUT);
+		}
+		return;
+	}
+	else if (gv_path_in.empty() && arg_iter + 1 == argc) // if last argument is text
 		return;
 	else if (!gv_path_in.empty()) // if we have input file argument
 		return;
@@ -182,340 +680,608 @@ void InterpretParameters(int &argc, char ** &argv) {
 	}
 }
 
-void SaveInput(int &argc, char ** &argv) {
-	FILE * file_in;
+// reads the text from input file or from the last argument
+void LoadInput(int &argc, char ** &argv, std::wstring &arg_text) {
 	std::string buffer_ascii;
 
 	if (gv_path_in.empty()) {
-		gv_path_in = L"~temp\\temp_input.txt";
 		buffer_ascii = argv[argc - 1];
-		std::wstring input(buffer_ascii.begin(), buffer_ascii.end());
-		if ((file_in = _wfopen(gv_path_in.c_str(), FOPEN_MODE_WRITE_UTF8_W)) == NULL) {
-			DirectoryDeleteSys("~temp");
-			exit(EXIT_ERROR_FOPEN);
-		}
-		fwprintf(file_in, L"%s", input.c_str());
-		fclose(file_in);
+		arg_text.assign(buffer_ascii.begin(), buffer_ascii.end());
+	}
+	else {
+		FileLoad(gv_path_in.c_str(), FOPEN_MODE_READ_UTF8_W, arg_text);
+		// text mode reads less characters than the file has bytes
+		arg_text.resize(wcslen(arg_text.c_str()));
 	}
 }
 
-void Tokenize(std::wstring &arg_str) {
-	std::string path_in_ascii(gv_path_in.begin(), gv_path_in.end()),
-		command = std::string() + "java \"edu.stanford.nlp.process.DocumentPreprocessor\" -tokenizerOptions \"asciiQuotes=true\" \"" + path_in_ascii.c_str() + "\" | java \"edu.stanford.nlp.process.PTBTokenizer\" -options \"tokenizeNLs=true,asciiQuotes=true\" >\"~temp\\temp_tokenizer.txt\"";
+void Tokenize(const std::wstring &arg_text, std::wstring &arg_str) {
+	if (gv_tokenizer == TOKENIZER_NATIVE) {
+		TokenizeText(arg_text, arg_str);
+		return;
+	}
+	if (gv_tokenizer == TOKENIZER_COPROCESS) {
+		TokenizeCoprocess(arg_text, arg_str);
+		return;
+	}
+
+	SaveInput(arg_text, L"~temp\\temp_input.txt");
+	std::string command = std::string() + "java \"edu.stanford.nlp.process.DocumentPreprocessor\" -tokenizerOptions \"asciiQuotes=true\" \"~temp\\temp_input.txt\" | java \"edu.stanford.nlp.process.PTBTokenizer\" -options \"tokenizeNLs=true,asciiQuotes=true\" >\"~temp\\temp_tokenizer.txt\"";
 	system(command.c_str());
 	std::wstring file_path = L"~temp\\temp_tokenizer.txt";
 	FileLoad(file_path.c_str(), FOPEN_MODE_READ_UTF8_W, arg_str);
 	StringReplaceAllAlter(arg_str, L"\n*NL*\n", L"\n\n");
 }
 
-// initializes vlib.h, vector file and variables required
-void VlibInitialize(int **arg_id, float **arg_vector, float **arg_dist, float **arg_rel, int vector_n_max) {
-	read_vectors("vec-300sk.bin");
-	if ((*arg_vector = (float*)malloc(vsize*sizeof(float))) == NULL) {
-		fprintf(stderr, "Error: Unable to allocate %d for arg_vector\n", vsize*sizeof(float));
-		exit(EXIT_ERROR_MALLOC);
-	}
-	if ((*arg_id = (int*)malloc(vector_n_max*sizeof(int))) == NULL)
-		fprintf(stderr, "Error: Unable to allocate %d for arg_id\n", vector_n_max*sizeof(int));
-	exit(EXIT_ERROR_MALLOC);
-	if ((*arg_dist = (float*)malloc(vector_n_max*sizeof(float))) == NULL)
-		fprintf(stderr, "Error: Unable to allocate %d for arg_id\n", vector_n_max*sizeof(float));
-	exit(EXIT_ERROR_MALLOC);
-	if ((*arg_rel = (float*)malloc(words*sizeof(float))) == NULL)
-		fprintf(stderr, "Error: Unable to allocate %d for arg_rel\n", words*sizeof(float));
-	exit(EXIT_ERROR_MALLOC);
+// initializes vlib.h, vector file and variables required; vectors and k-NN cache stay in memory for all documents
+void VlibInitialize(int vector_n_max) {
+	if (gv_vector_loaded)
+		return;
+	gv_vector_loaded = TRUE;
+	cache_capacity = gv_knn_cache_words;
+	// with the table of neighbours only the vocabulary is used, the matrix of indexed vectors stays on disk
+	if (!gv_neighbors_path.empty() && gv_neighbors_build.empty()) {
+		if (is_vectors_indexed(gv_vector_path.c_str()))
+			map_vectors(gv_vector_path.c_str(), gv_vector_huge_pages, gv_vector_prefault);
+		else
+			read_vocab(gv_vector_path.c_str());
+		map_neighbor_table(gv_neighbors_path.c_str(), FEATURE_VECTORS);
+	}
+	// indexed vectors are only mapped
+	else if (gv_vector_map || is_vectors_indexed(gv_vector_path.c_str()))
+		map_vectors(gv_vector_path.c_str(), gv_vector_huge_pages, gv_vector_prefault);
+	else
+		read_vectors(gv_vector_path.c_str());
+	if (!gv_quantized_path.empty() && neighbor_table == NULL)
+		map_vectors_quantized(gv_quantized_path.c_str());
+	// the tree replaces the scan over all vectors
+	if (!gv_vp_tree_path.empty() && neighbor_table == NULL) {
+		map_vp_tree(gv_vp_tree_path.c_str());
+		knn_backend = VLIB_KNN_VP_TREE;
+	}
+	// approximate search in the graph
+	else if (!gv_hnsw_path.empty() && neighbor_table == NULL) {
+		map_hnsw(gv_hnsw_path.c_str());
+		knn_backend = VLIB_KNN_HNSW;
+	}
+	// hamming scan over the sketches, exact rerank of the shortlist
+	else if (gv_sketch && neighbor_table == NULL) {
+		build_sketches();
+		knn_backend = VLIB_KNN_SKETCH;
+	}
+	if (!gv_knn_cache_path.empty() && gv_neighbors_path.empty())
+		open_cache_file(gv_knn_cache_path.c_str(), vector_n_max, gv_knn_cache_size * MB);
+	if (gv_vector_filter)
+		build_word_filter();
 }
 
-// sets binary variables for token
-void StringAbout(TOKEN &arg_token) {
-	int i;
-	size_t len = arg_token.word.length();
-	arg_token.is_full_upper = TRUE;
-	arg_token.is_semi_upper = arg_token.contains_punct = arg_token.contains_digit = FALSE;
+// sets binary variables for word
+void StringAbout(const wchar_t *arg_word, size_t arg_length, TOKEN_SHAPE &arg_shape) {
+	size_t i;
+	arg_shape.is_full_upper = TRUE;
+	arg_shape.is_semi_upper = arg_shape.contains_punct = arg_shape.contains_digit = FALSE;
 
 	// is first upper
-	if (iswpunct(arg_token.word.at(FALSE))) {
-		arg_token.contains_punct = TRUE;
-		arg_token.is_full_upper = arg_token.is_first_upper = FALSE;
+	if (iswpunct(arg_word[0])) {
+		arg_shape.contains_punct = TRUE;
+		arg_shape.is_full_upper = arg_shape.is_first_upper = FALSE;
 	}
-	else if (iswdigit(arg_token.word.at(FALSE))) {
-		arg_token.contains_digit = TRUE;
-		arg_token.is_full_upper = arg_token.is_first_upper = FALSE;
+	else if (iswdigit(arg_word[0])) {
+		arg_shape.contains_digit = TRUE;
+		arg_shape.is_full_upper = arg_shape.is_first_upper = FALSE;
 	}
-	else if (iswupper(arg_token.word.at(FALSE))) {
-		arg_token.is_semi_upper = arg_token.is_first_upper = TRUE;
+	else if (iswupper(arg_word[0])) {
+		arg_shape.is_semi_upper = arg_shape.is_first_upper = TRUE;
 	}
 	else {
-		arg_token.is_full_upper = arg_token.is_first_upper = FALSE;
+		arg_shape.is_full_upper = arg_shape.is_first_upper = FALSE;
 	}
 
 	// is full or semiupper
-	for (i = TRUE; i < len; ++i) {
-		if (iswpunct(arg_token.word.at(i))) {
-			arg_token.contains_punct = TRUE;
-			arg_token.is_full_upper = FALSE;
+	for (i = TRUE; i < arg_length; ++i) {
+		if (iswpunct(arg_word[i])) {
+			arg_shape.contains_punct = TRUE;
+			arg_shape.is_full_upper = FALSE;
 		}
-		else if (iswdigit(arg_token.word.at(i))) {
-			arg_token.contains_digit = TRUE;
-			arg_token.is_full_upper = FALSE;
+		else if (iswdigit(arg_word[i])) {
+			arg_shape.contains_digit = TRUE;
+			arg_shape.is_full_upper = FALSE;
 		}
-		else if (iswupper(arg_token.word.at(i))) {
-			arg_token.is_semi_upper = TRUE;
+		else if (iswupper(arg_word[i])) {
+			arg_shape.is_semi_upper = TRUE;
 		}
 		else {
-			arg_token.is_full_upper = FALSE;
+			arg_shape.is_full_upper = FALSE;
 		}
 	}
 }
 
-void PreprocessText(std::wstring arg_str, size_t &arg_tokens_count, TOKEN * &arg_tokens) {
-	FILE * file;
-	size_t i, j,
-		start, end = 0, sentence_position = 0,
-		cut;
-	int k, l;
-	std::wstring word_stripped,
-		buffer_token = L"", temp_path;
-	wchar_t buffer[2048];
-	float *vector, *dist, *rel;
-	int *vec_id = NULL, word_id, ret_k;
-
-	temp_path = L"~temp\\temp_crf.txt";
-	if ((file = _wfopen(temp_path.c_str(), FOPEN_MODE_WRITE_UTF8_W)) == NULL) {
-		exit(EXIT_ERROR_FOPEN);
+// loads the model matching the vector flag; the model stays in memory for all documents
+void CrfInitialize() {
+	if (gv_use_vector)
+		CrfModelLoad("crf-vec-1pct.mdl", gv_crf_model);
+	else
+		CrfModelLoad("crf-10pct.mdl", gv_crf_model);
+}
+
+// resolves the feature names ("w[-1]", "f7[0]", ...) to attribute groups of the model once
+void FeatureInitialize() {
+	int f, k;
+	char name[16];
+
+	for (f = 0; f <= FEATURE_TEMPLATES; ++f) {
+		for (k = 0; k < FEATURE_OFFSETS; ++k) {
+			if (f == 0)
+				sprintf(name, "w[%d]", k - 2);
+			else if (f == FEATURE_TEMPLATES)
+				sprintf(name, "v[%d]", k - 2);
+			else
+				sprintf(name, "f%d[%d]", f - 1, k - 2);
+			gv_feature_groups[f][k] = CrfGroupId(gv_crf_model, name);
+		}
 	}
+	gv_attribute_bos = CrfAttributeId(gv_crf_model, "__BOS__");
+	gv_attribute_eos = CrfAttributeId(gv_crf_model, "__EOS__");
+}
+
+// converts part of the escaped lowercase word to the form the model stores: UTF-8 without escapes
+inline const std::string& FeatureValue(const std::wstring &arg_lowercase, size_t arg_offset, size_t arg_length, std::string &arg_value) {
+	StringToUtf8Alter(arg_lowercase.c_str() + arg_offset, arg_length, arg_value);
+	return CrfUnescapeAlter(arg_value);
+}
+
+// looks up attribute ids of token arg_index for every feature and offset it is used at; values are computed
+// from the escaped lowercase word as the model was trained, affixes are (offset, length) pairs in it
+void TokenAttributes(TOKEN_STORE &arg_tokens, size_t arg_index, const TOKEN_SHAPE &arg_shape, const int *arg_vector, TOKEN_SCRATCH &arg_scratch) {
+	int f, k, l, *attribute = arg_tokens.attribute + arg_index * FEATURE_COUNT * FEATURE_OFFSETS;
+	size_t length = arg_scratch.lowercase.length(), cut;
+	LONG numbers[7] = { arg_shape.is_first_upper, arg_shape.is_full_upper, arg_shape.is_semi_upper,
+		arg_shape.contains_punct, arg_shape.contains_digit, (LONG)length, (LONG)arg_tokens.sentence_position[arg_index] };
+
+	FeatureValue(arg_scratch.lowercase, 0, length, arg_scratch.value);
+	for (k = 0; k < FEATURE_OFFSETS; ++k)
+		attribute[k] = CrfGroupValueId(gv_crf_model, gv_feature_groups[0][k], arg_scratch.value);
+	for (f = 1; f < 8; ++f) {
+		for (k = 0; k < FEATURE_OFFSETS; ++k)
+			attribute[f * FEATURE_OFFSETS + k] = CrfGroupNumberId(gv_crf_model, gv_feature_groups[f][k], numbers[f - 1]);
+	}
+	for (l = 0; l < 4; ++l) {
+		cut = l + 1;
+		// prefix
+		FeatureValue(arg_scratch.lowercase, 0, MIN(cut, length), arg_scratch.value);
+		for (k = 0; k < FEATURE_OFFSETS; ++k)
+			attribute[(8 + l) * FEATURE_OFFSETS + k] = CrfGroupValueId(gv_crf_model, gv_feature_groups[8 + l][k], arg_scratch.value);
+		// suffix, whole word when it is shorter
+		if (length < cut)
+			FeatureValue(arg_scratch.lowercase, 0, length, arg_scratch.value);
+		else
+			FeatureValue(arg_scratch.lowercase, length - cut, cut, arg_scratch.value);
+		for (k = 0; k < FEATURE_OFFSETS; ++k)
+			attribute[(12 + l) * FEATURE_OFFSETS + k] = CrfGroupValueId(gv_crf_model, gv_feature_groups[12 + l][k], arg_scratch.value);
+	}
+	// empty line tokens have no vector
+	for (l = 0; l < FEATURE_VECTORS; ++l) {
+		for (k = 0; k < FEATURE_OFFSETS; ++k)
+			attribute[(FEATURE_TEMPLATES + l) * FEATURE_OFFSETS + k] = (arg_vector == NULL) ? -1 :
+				CrfGroupNumberId(gv_crf_model, gv_feature_groups[FEATURE_TEMPLATES][k], arg_vector[l]);
+	}
+}
+
+// finds token arg_index in the vocabulary of vectors
+void TokenWordId(TOKEN_STORE &arg_tokens, size_t arg_index) {
+	static thread_local TOKEN_SCRATCH scratch;
+	const wchar_t *word = arg_tokens.text + arg_tokens.word_begin[arg_index];
+	size_t length = arg_tokens.word_length[arg_index];
+
+	scratch.stripped.assign(word, length);
+	// remove diacritics for vlib.h
+	StringRemoveDiacriticsAlter(scratch.stripped);
+	scratch.ascii.assign(scratch.stripped.begin(), scratch.stripped.end());
+	// the vocabulary index is only read, no lock needed
+	arg_tokens.word_id[arg_index] = length ? get_word_index(scratch.ascii.c_str()) : -1;
+}
+
+// generates features of token arg_index
+void TokenFeatures(TOKEN_STORE &arg_tokens, size_t arg_index) {
+	static thread_local TOKEN_SCRATCH scratch;
+	const wchar_t *word = arg_tokens.text + arg_tokens.word_begin[arg_index];
+	size_t j, length = arg_tokens.word_length[arg_index];
+	int word_id, ret_k = 0, *vector = NULL;
+	TOKEN_SHAPE shape = { FALSE, FALSE, FALSE, FALSE, FALSE };
+
+	scratch.lowercase.assign(word, length);
+	StringToLowerAlter(scratch.lowercase);
+	StringReplaceAllAlter(scratch.lowercase, L" ", L"_");
+	StringReplaceAllAlter(scratch.lowercase, L"|", L"*");
+	StringReplaceAllAlter(scratch.lowercase, L"\\", L"\\\\");
+	StringReplaceAllAlter(scratch.lowercase, L":", L"\\:");
+	if (length)
+		StringAbout(word, length, shape);
+	if (length && gv_use_vector) {
+		vector = arg_tokens.vector + arg_index * FEATURE_VECTORS;
+		word_id = arg_tokens.word_id[arg_index];
+		if (word_id < 0) {
+			for (j = 0; j < FEATURE_VECTORS; ++j)
+				vector[j] = -1;
+		}
+		// the table is only read, no lock needed
+		else if (neighbor_table != NULL)
+			neighbor_table_lookup(word_id, FEATURE_VECTORS, vector);
+		// unless PreprocessText searched the whole text at once
+		else if (!arg_tokens.vector_filled) {
+			// the indexes answer single words, the k-NN cache is safe for all threads and a word missing in
+			// it is searched once
+			scratch.vector.resize(vsize);
+			scratch.nearest.resize(FEATURE_VECTORS);
+			scratch.distance.resize(FEATURE_VECTORS);
+			int *nearest = scratch.nearest.data();
+			float *distance = scratch.distance.data(), *target = scratch.vector.data();
+			get_word_vector(word_id, target);
+			ret_k = k_nearest3(target, FEATURE_VECTORS, nearest, distance, word_id);
+			for (j = 0; j < FEATURE_VECTORS; ++j)
+				vector[j] = ((int)j >= ret_k) ? -1 : nearest[j];
+		}
+	}
+	TokenAttributes(arg_tokens, arg_index, shape, vector, scratch);
+}
+
+// builds the instance of sentence arg_begin..arg_end; features of the first tokens reach the tokens before it
+void SentenceInstance(const TOKEN_STORE &arg_tokens, size_t arg_begin, size_t arg_end, CRF_INSTANCE &arg_instance) {
+	size_t i;
+	int f, k, features = FEATURE_TEMPLATES + (gv_use_vector ? FEATURE_VECTORS : 0);
+
+	CrfInstanceClear(arg_instance);
+	for (i = arg_begin; i < arg_end; ++i) {
+		CrfInstanceAddItem(arg_instance);
+		for (f = 0; f < features; ++f) {
+			for (k = -2; k <= 0; ++k) {
+				// window does not reach before the first token of the text
+				if (i < (size_t)(-k))
+					continue;
+				CrfInstanceAddAttribute(arg_instance, arg_tokens.attribute[((i + k) * FEATURE_COUNT + f) * FEATURE_OFFSETS + k + 2]);
+			}
+		}
+
+		// sentence ends before the empty line token or at the end of text
+		if (i + 1 == arg_end)
+			CrfInstanceAddAttribute(arg_instance, gv_attribute_eos);
+		else if (arg_tokens.sentence_position[i] == 0)
+			CrfInstanceAddAttribute(arg_instance, gv_attribute_bos);
+	}
+}
+
+// splits the tokenized text into the token store allocated from arg_arena and builds instances of all sentences
+void PreprocessText(const std::wstring &arg_str, ARENA &arg_arena, TOKEN_STORE &arg_tokens, std::vector<CRF_INSTANCE> &arg_instances) {
+	size_t i, count = 0,
+		start, end = 0, sentence_position = 0;
+	std::vector<size_t> sentence_begin, sentence_end;
 
-	arg_tokens_count = 0;
 	for (i = 0; i < arg_str.size(); ++i) {
 		if (arg_str[i] == '\n')
-			++arg_tokens_count;
+			++count;
 	}
 
-	arg_tokens = new TOKEN[arg_tokens_count];
+	arg_tokens.count = count;
+	arg_tokens.text = arg_str.c_str();
+	arg_tokens.word_begin = ArenaArray<size_t>(arg_arena, count);
+	arg_tokens.word_length = ArenaArray<size_t>(arg_arena, count);
+	arg_tokens.sentence_position = ArenaArray<size_t>(arg_arena, count);
+	arg_tokens.attribute = ArenaArray<int>(arg_arena, count * FEATURE_COUNT * FEATURE_OFFSETS);
+	arg_tokens.word_id = gv_use_vector ? ArenaArray<int>(arg_arena, count) : NULL;
+	arg_tokens.vector = gv_use_vector ? ArenaArray<int>(arg_arena, count * FEATURE_VECTORS) : NULL;
+	arg_tokens.vector_filled = FALSE;
 
-	// fill array with tokens from text
-	for (i = 0; i < arg_tokens_count; ++i) {
+	// fill arrays with views of tokens in text
+	for (i = 0; i < count; ++i) {
 		start = end;
-		end = arg_str.find(L"\n", start);
+		end = arg_str.find(L'\n', start);
+		arg_tokens.word_begin[i] = start;
+		arg_tokens.word_length[i] = end - start;
 		if (end - start == 0) {
-			++end;
 			sentence_position = -1;
-			arg_tokens[i].word = '\n';
-		}
-		else {
-			++end;
-			arg_tokens[i].sentence_position = sentence_position;
-			arg_tokens[i].word = arg_str.substr(start, end - start - 1);
+			arg_tokens.sentence_position[i] = 0;
 		}
+		else
+			arg_tokens.sentence_position[i] = sentence_position;
+		++end;
 		++sentence_position;
 	}
 
-	// initialize vector if we need it
-	if (gv_use_vector)
-		VlibInitialize(&vec_id, &vector, &dist, &rel, 20);
-
-	// generate features for tokens
-	for (i = 0; i < arg_tokens_count; ++i) {
-		if (arg_tokens[i].word == L"\n")
+	// sentences are runs of tokens between empty lines, features reaching empty lines have empty values
+	for (i = 0; i < count; ++i) {
+		if (arg_tokens.word_length[i] == 0) {
+			TokenFeatures(arg_tokens, i);
 			continue;
-		arg_tokens[i].word_lowercase = StringToLower(arg_tokens[i].word);
-		StringReplaceAllAlter((arg_tokens[i].word_lowercase), L" ", L"_");
-		StringReplaceAllAlter((arg_tokens[i].word_lowercase), L"|", L"*");
-		StringReplaceAllAlter((arg_tokens[i].word_lowercase), L"\\", L"\\\\");
-		StringReplaceAllAlter((arg_tokens[i].word_lowercase), L":", L"\\:");
-		StringAbout(arg_tokens[i]);
-		arg_tokens[i].word_length = (arg_tokens[i].word_lowercase).length();
-		for (j = 0; j < 4; ++j) {
-			cut = j + 1;
-			(arg_tokens[i].prefix)[j] = (arg_tokens[i].word_lowercase).substr(0, cut);
-			if (arg_tokens[i].word_length < cut)
-				(arg_tokens[i].suffix)[j] = (arg_tokens[i].word_lowercase).substr(0, cut);
-			else
-				(arg_tokens[i].suffix)[j] = (arg_tokens[i].word_lowercase).substr(arg_tokens[i].word_length - cut, cut);
-		}
-		if (gv_use_vector) {
-			word_stripped = arg_tokens[i].word;
-			// remove diacritics for vlib.h
-			StringRemoveDiacriticsAlter(word_stripped);
-			std::string word_ascii(word_stripped.begin(), word_stripped.end());
-			word_id = get_word_index(word_ascii.c_str(), vector);
-			if (word_id >= 0) {
-				ret_k = k_nearest3(vector, 20, vec_id, dist, word_id);
-			}
-			arg_tokens[i].vector = new int[20];
-			for (j = 0; j < 20; ++j) {
-				if ((word_id < 0) || (j > ret_k))
-					(arg_tokens[i].vector)[j] = -1;
-				else
-					(arg_tokens[i].vector)[j] = vec_id[j];
-			}
 		}
+		if (i == 0 || arg_tokens.word_length[i - 1] == 0)
+			sentence_begin.push_back(i);
+		if (i + 1 == count || arg_tokens.word_length[i + 1] == 0)
+			sentence_end.push_back(i + 1);
 	}
 
-	for (i = 0; i < arg_tokens_count; ++i) {
-		if (arg_tokens[i].word == L"\n") {
-			continue;
-		}
+	// neighbours of all distinct words of the text are searched together in one pass over the vectors
+	if (gv_use_vector) {
+		for (i = 0; i < count; ++i)
+			arg_tokens.word_id[i] = -1;
+		ThreadPoolFor(gv_pool, sentence_begin.size(), [&](size_t s) {
+			for (size_t j = sentence_begin[s]; j < sentence_end[s]; ++j)
+				TokenWordId(arg_tokens, j);
+		});
+		arg_tokens.vector_filled = neighbor_table == NULL && k_nearest3_cached(arg_tokens.word_id, (int)count, FEATURE_VECTORS, arg_tokens.vector);
+	}
 
-		buffer_token += L"X";
-		for (k = -2; k <= 2; ++k) {
-			if ((i < k * (-1)) || (i + k >= arg_tokens_count))
-				continue;
-			swprintf(buffer, L"\tw[%d]=%s", k, arg_tokens[i + k].word_lowercase.c_str());
-			buffer_token += buffer;
-		}
-		for (k = -2; k <= 2; ++k) {
-			if ((i < k * (-1)) || (i + k >= arg_tokens_count))
-				continue;
-			swprintf(buffer, L"\tf0[%d]=%d", k, arg_tokens[i + k].is_first_upper);
-			buffer_token += buffer;
-		}
-		for (k = -2; k <= 2; ++k) {
-			if ((i < k * (-1)) || (i + k >= arg_tokens_count))
-				continue;
-			swprintf(buffer, L"\tf1[%d]=%d", k, arg_tokens[i + k].is_full_upper);
-			buffer_token += buffer;
-		}
-		for (k = -2; k <= 2; ++k) {
-			if ((i < k * (-1)) || (i + k >= arg_tokens_count))
-				continue;
-			swprintf(buffer, L"\tf2[%d]=%d", k, arg_tokens[i + k].is_semi_upper);
-			buffer_token += buffer;
-		}
-		for (k = -2; k <= 2; ++k) {
-			if ((i < k * (-1)) || (i + k >= arg_tokens_count))
-				continue;
-			swprintf(buffer, L"\tf3[%d]=%d", k, arg_tokens[i + k].contains_punct);
-			buffer_token += buffer;
-		}
-		for (k = -2; k <= 2; ++k) {
-			if ((i < k * (-1)) || (i + k >= arg_tokens_count))
-				continue;
-			swprintf(buffer, L"\tf4[%d]=%d", k, arg_tokens[i + k].contains_digit);
-			buffer_token += buffer;
-		}
-		for (k = -2; k <= 2; ++k) {
-			if ((i < k * (-1)) || (i + k >= arg_tokens_count))
-				continue;
-			swprintf(buffer, L"\tf5[%d]=%llu", k, arg_tokens[i + k].word_length);
-			buffer_token += buffer;
-		}
-		for (k = -2; k <= 2; ++k) {
-			if ((i < k * (-1)) || (i + k >= arg_tokens_count))
-				continue;
-			swprintf(buffer, L"\tf6[%d]=%llu", k, arg_tokens[i + k].sentence_position);
-			buffer_token += buffer;
-		}
-		for (l = 0; l < 4; ++l) {
-			for (k = -2; k <= 2; ++k) {
-				if ((i < k * (-1)) || (i + k >= arg_tokens_count))
-					continue;
-				swprintf(buffer, L"\tf%d[%d]=%s", l + 7, k, (arg_tokens[i + k].prefix)[l].c_str());
-				buffer_token += buffer;
-			}
+	// all tokens have their features before instances read the neighbouring sentences
+	ThreadPoolFor(gv_pool, sentence_begin.size(), [&](size_t s) {
+		for (size_t j = sentence_begin[s]; j < sentence_end[s]; ++j)
+			TokenFeatures(arg_tokens, j);
+	});
+	arg_instances.resize(sentence_begin.size());
+	ThreadPoolFor(gv_pool, sentence_begin.size(), [&](size_t s) {
+		SentenceInstance(arg_tokens, sentence_begin[s], sentence_end[s], arg_instances[s]);
+	});
+}
+
+// decodes every sentence, output has the format of "crfsuite tag": one label per line, empty line after sentence
+void CrfTag(std::vector<CRF_INSTANCE> &arg_instances, std::wstring &arg_output) {
+	size_t i, j;
+	std::vector<std::vector<int>> labels(arg_instances.size());
+	std::vector<std::wstring> labels_w(gv_crf_model.labels.size());
+
+	for (i = 0; i < labels_w.size(); ++i)
+		labels_w[i] = StringFromUtf8(gv_crf_model.labels[i]);
+
+	ThreadPoolFor(gv_pool, arg_instances.size(), [&](size_t s) {
+		CrfViterbi(gv_crf_model, arg_instances[s], labels[s]);
+	});
+
+	// sentences are written in the original order
+	arg_output.clear();
+	for (i = 0; i < labels.size(); ++i) {
+		for (j = 0; j < labels[i].size(); ++j) {
+			arg_output += labels_w[labels[i][j]];
+			arg_output += L"\n";
 		}
-		for (l = 0; l < 4; ++l) {
-			for (k = -2; k <= 2; ++k) {
-				if ((i < k * (-1)) || (i + k >= arg_tokens_count))
-					continue;
-				swprintf(buffer, L"\tf%d[%d]=%s", l + 11, k, (arg_tokens[i + k].suffix)[l].c_str());
-				buffer_token += buffer;
-			}
+		arg_output += L"\n";
+	}
+}
+
+// formats the tags for output; with map flag every token is followed by its tag
+void FormatTags(std::wstring &arg_tags, const TOKEN_STORE &arg_tokens, std::wstring &arg_output) {
+	size_t i, tag_iter = 0;
+	if (!gv_use_mapping) {
+		arg_output = arg_tags;
+		return;
+	}
+	StringReplaceAllAlter(arg_tags, L"\n", L"");
+	StringReplaceAllAlter(arg_tags, L"\r", L"");
+	arg_output.clear();
+	for (i = 0; i < arg_tokens.count; ++i) {
+		if (arg_tokens.word_length[i] == 0) {
+			arg_output += L"\n";
 		}
-		if (gv_use_vector) {
-			for (l = 0; l < 20; ++l) {
-				for (k = -2; k <= 2; ++k) {
-					if ((i < k * (-1)) || (i + k >= arg_tokens_count))
-						continue;
-					swprintf(buffer, L"\tv[%d]=%d", k, (arg_tokens[i + k].vector)[l]);
-					buffer_token += buffer;
-				}
-			}
+		else {
+			arg_output.append(arg_tokens.text + arg_tokens.word_begin[i], arg_tokens.word_length[i]);
+			arg_output += L' ';
+			arg_output += arg_tags.at(tag_iter);
+			arg_output += L'\n';
+			++tag_iter;
 		}
+	}
+}
 
-		if ((i <= (arg_tokens_count + 1)) && (arg_tokens[i].sentence_position >= arg_tokens[i + 1].sentence_position))
-			buffer_token += L"\t__EOS__\n\n";
-		else if (arg_tokens[i].sentence_position == 0)
-			buffer_token += L"\t__BOS__\n";
-		else
-			buffer_token += L"\n";
+// prints to output or file
+void OutputTags(const std::wstring &arg_output) {
+	if (gv_path_out.empty())
+		wprintf(L"%s", arg_output.c_str());
+	else
+		fwprintf(gv_file_out, L"%s", arg_output.c_str());
+}
+
+// tags one document with the resident models, arg_output is formatted for printing
+void TagText(const std::wstring &arg_text, std::wstring &arg_output) {
+	std::wstring tokenized, tags;
+	TOKEN_STORE tokens;
+	std::vector<CRF_INSTANCE> instances;
+
+	arg_output.clear();
+	// the java pipeline writes no output for empty text
+	if (arg_text.find_first_not_of(L" \t\r\n") == std::wstring::npos)
+		return;
+	Tokenize(arg_text, tokenized);
+	// token arrays of the previous document are released at once
+	ArenaReset(gv_arena);
+	PreprocessText(tokenized, gv_arena, tokens, instances);
+	CrfTag(instances, tags);
+	FormatTags(tags, tokens, arg_output);
+}
 
-		fputws(buffer_token.c_str(), file);
-		buffer_token = L"";
+// finds where the text may be cut: at the last space after the end of a sentence, or when there is none and
+// the text has grown over twice the window, after the last line or space; 0 means more text has to be read
+size_t StreamCut(const std::wstring &arg_text, size_t arg_window) {
+	size_t i;
+
+	for (i = arg_text.size(); i > 0; --i) {
+		if (TokenIsSpace(arg_text[i - 1]) && TokenIsSentenceEndAt(arg_text, i - 1))
+			return i;
 	}
+	if (arg_text.size() < 2 * arg_window)
+		return 0;
+	if ((i = arg_text.find_last_of(L'\n')) != std::wstring::npos)
+		return i + 1;
+	if ((i = arg_text.find_last_of(L" \t")) != std::wstring::npos)
+		return i + 1;
+	return arg_text.size();
+}
 
-	fclose(file);
+// TRUE when the text ends with an empty line
+BOOL StreamEndsParagraph(const std::wstring &arg_text) {
+	size_t i = arg_text.find_last_not_of(L" \t\r");
+	if (i == std::wstring::npos || arg_text[i] != L'\n')
+		return FALSE;
+	i = arg_text.find_last_not_of(L" \t\r", i - 1);
+	return i == std::wstring::npos || arg_text[i] == L'\n';
 }
 
-void CrfTag(std::wstring &arg_output) {
-	std::wstring command = L"crfsuite.exe tag -m \"";
-	if (gv_use_vector) {
-		command += L"crf-vec-1pct.mdl\" \"~temp\\temp_crf.txt\"";
+// reads, tags and writes the input in windows of whole sentences, memory is bounded by gv_stream_memory;
+// with flush flag every complete sentence is written right after its line is read
+void TagStream(FILE *arg_in, BOOL arg_flush) {
+	size_t window = gv_stream_memory * MB / STREAM_BYTES_PER_CHAR, cut;
+	wchar_t buffer[4096];
+	std::wstring text, output;
+	BOOL end = FALSE;
+
+	while (!end) {
+		if (fgetws(buffer, sizeof(buffer) / sizeof(wchar_t), arg_in) != NULL)
+			text += buffer;
+		else
+			end = TRUE;
+		if (text.size() < window && !end && !arg_flush)
+			continue;
+		if (end || (arg_flush && StreamEndsParagraph(text)))
+			cut = text.size();
+		else if ((cut = StreamCut(text, window)) == 0)
+			continue;
+		TagText(text.substr(0, cut), output);
+		OutputTags(output);
+		if (arg_flush)
+			fflush(gv_file_out != NULL ? gv_file_out : stdout);
+		text.erase(0, cut);
 	}
-	else {
-		command += L"crf-10pct.mdl\" \"~temp\\temp_crf.txt\"";
+}
+
+// answers framed requests until the end of input; request is UTF-8 text, response the formatted tags
+void ServeStream(FILE *arg_in, FILE *arg_out) {
+	std::string request;
+	std::wstring output;
+
+	while (FrameRead(arg_in, request)) {
+		TagText(StringFromUtf8(request), output);
+		if (!FrameWrite(arg_out, StringToUtf8(output)))
+			break;
 	}
-	arg_output = Execute(command.c_str());
 }
 
-// prints to output or file; formats the output differently based on map flag
-void OutputTags(std::wstring &arg_output, size_t arg_tokens_count, TOKEN * &arg_tokens) {
-	size_t i, tag_iter = 0;
-	if (gv_use_mapping) {
-		StringReplaceAllAlter(arg_output, L"\n", L"");
-		StringReplaceAllAlter(arg_output, L"\r", L"");
-		if (gv_path_out.empty()) {
-			for (i = 0; i < arg_tokens_count; ++i) {
-				if (arg_tokens[i].word == L"\n") {
-					putchar('\n');
-				}
-				else {
-					wprintf(L"%s %c\n", arg_tokens[i].word.c_str(), arg_output.at(tag_iter));
-					++tag_iter;
-				}
-			}
-		}
-		else {
-			for (i = 0; i < arg_tokens_count; ++i) {
-				if (arg_tokens[i].word == L"\n") {
-					putchar('\n');
-				}
-				else {
-					fwprintf(gv_file_out, L"%s %c\n", arg_tokens[i].word.c_str(), arg_output.at(tag_iter));
-					++tag_iter;
-				}
-			}
-			fclose(gv_file_out);
-		}
+#ifndef _WIN32
+// serves clients of the unix domain socket one after another
+void ServeSocket(const char *arg_path) {
+	int server, client;
+	FILE *in, *out;
+
+	if ((server = SocketListenLocal(arg_path)) < 0) {
+		fprintf(stderr, "Error: Unable to listen on %s\n", arg_path);
+		DirectoryDeleteSys("~temp");
+		exit(EXIT_ERROR_HANDLE);
 	}
-	else {
-		if (gv_path_out.empty()) {
-			wprintf(L"%s", arg_output.c_str());
-		}
-		else {
-			fwprintf(gv_file_out, L"%s", arg_output.c_str());
-			fclose(gv_file_out);
-		}
+	for (;;) {
+		if ((client = accept(server, NULL, NULL)) < 0)
+			continue;
+		in = fdopen(client, "rb");
+		out = fdopen(dup(client), "wb");
+		if (in != NULL && out != NULL)
+			ServeStream(in, out);
+		if (in != NULL)
+			fclose(in);
+		else
+			close(client);
+		if (out != NULL)
+			fclose(out);
 	}
 }
+#endif
+
+// joins the workers, also when the program exits on error
+void PoolStop() {
+	ThreadPoolStop(gv_pool);
+}
 
 int main(int argc, char *argv[]) {
 	std::wstring input, output;
-	size_t tokens_count = 0;
-	TOKEN * tokens;
 
 	SET_LOCALE("slovak");
 	InterpretParameters(argc, argv);
+	if (!gv_vector_convert.empty()) {
+		VlibInitialize(20);
+		write_vectors_indexed(gv_vector_convert.c_str());
+		return EXIT_SUCCESS;
+	}
+	if (!gv_neighbors_build.empty()) {
+		VlibInitialize(20);
+		write_neighbor_table(gv_neighbors_build.c_str(), FEATURE_VECTORS);
+		return EXIT_SUCCESS;
+	}
+	if (!gv_vp_tree_build.empty()) {
+		VlibInitialize(20);
+		write_vp_tree(gv_vp_tree_build.c_str());
+		return EXIT_SUCCESS;
+	}
+	if (!gv_hnsw_build.empty()) {
+		VlibInitialize(20);
+		write_hnsw(gv_hnsw_build.c_str());
+		knn_backend = VLIB_KNN_HNSW;
+		knn_recall(KNN_RECALL_QUERIES, FEATURE_VECTORS);
+		return EXIT_SUCCESS;
+	}
+	if (!gv_quantize.empty()) {
+		VlibInitialize(20);
+		write_vectors_quantized(gv_quantize.c_str(), gv_quantize_type);
+		return EXIT_SUCCESS;
+	}
+	if (gv_knn_recall) {
+		VlibInitialize(20);
+		knn_recall(KNN_RECALL_QUERIES, FEATURE_VECTORS);
+		return EXIT_SUCCESS;
+	}
 
-	DirectoryCreateSys("~temp");
+	// only the java pipeline needs temporary files
+	if (gv_tokenizer == TOKENIZER_STANFORD)
+		DirectoryCreateSys("~temp");
+	// models are loaded only once, server keeps them for all requests
+	CrfInitialize();
+	FeatureInitialize();
+	if (gv_use_vector)
+		VlibInitialize(20);
+	if (gv_threads > 1) {
+		ThreadPoolStart(gv_pool, gv_threads);
+		atexit(PoolStop);
+	}
 
-	SaveInput(argc, argv);
-	Tokenize(input);
-	PreprocessText(input, tokens_count, tokens);
-	CrfTag(output);
-	OutputTags(output, tokens_count, tokens);
+	if (gv_stdin) {
+		SET_UTF8_MODE(stdin);
+		TagStream(stdin, TRUE);
+	}
+	else if (gv_stream) {
+		FILE *file_in;
+		if ((file_in = _wfopen(gv_path_in.c_str(), FOPEN_MODE_READ_UTF8_W)) == NULL) {
+			fprintf(stderr, "Error: Unable to open input file\n");
+			DirectoryDeleteSys("~temp");
+			exit(EXIT_ERROR_FOPEN);
+		}
+		TagStream(file_in, FALSE);
+		fclose(file_in);
+	}
+	else if (!gv_server) {
+		LoadInput(argc, argv, input);
+		TagText(input, output);
+		OutputTags(output);
+	}
+#ifndef _WIN32
+	else if (!gv_socket_path.empty()) {
+		ServeSocket(gv_socket_path.c_str());
+	}
+#endif
+	else {
+		// frame lengths count bytes, no newline translation
+		SET_BINARY_MODE(stdin);
+		SET_BINARY_MODE(stdout);
+		ServeStream(stdin, stdout);
+	}
 
-	DirectoryDeleteSys("~temp");
+	if (gv_file_out != NULL)
+		fclose(gv_file_out);
+	if (gv_tokenizer == TOKENIZER_COPROCESS)
+		CoprocessClose(gv_tokenizer_process);
+	if (gv_tokenizer == TOKENIZER_STANFORD)
+		DirectoryDeleteSys("~temp");
 
 	return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,268 @@
+﻿// author:	Dalibor Mészáros
+// version:	0.01 native replacement for the Stanford DocumentPreprocessor | PTBTokenizer pipeline
+//
+// Splits text into Penn Treebank style tokens and sentences. The output has the same format as
+// the java pipeline with options "asciiQuotes=true" and "tokenizeNLs=true" after *NL* markers
+// are replaced: one token per line and an empty line after every sentence.
+
+#ifndef TOKENLIB_H
+#define TOKENLIB_H
+
+#include <wchar.h>
+#include <wctype.h>
+
+#include <string>
+#include <vector>
+
+#include "denralib.h"
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////  GLOBAL VARIABLES
+
+// abbreviations keeping their period (lowercase, without the final period)
+const wchar_t *_token_lib_gv_abbreviations[] = {
+	L"napr", L"tzv", L"resp", L"atď", L"príp", L"pozn", L"porov", L"vs", L"cca", L"tj", L"t.j", L"t.z", L"tzn",
+	L"č", L"čl", L"ods", L"písm", L"str", L"obr", L"tab", L"kap", L"zb", L"roč", L"tis", L"mil", L"mld",
+	L"hod", L"min", L"sek", L"ul", L"nám", L"tel", L"spol", L"a.s", L"s.r.o", L"sv", L"st", L"stor", L"pl",
+	L"ing", L"mgr", L"bc", L"dr", L"mudr", L"judr", L"rndr", L"phdr", L"paeddr", L"doc", L"prof", L"csc", L"phd",
+	L"gen", L"kpt", L"por", L"npor", L"mjr", L"plk", L"p", L"pp", L"mr", L"mrs", L"ms", L"jr", L"sr", L"etc", NULL
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////  CHARACTERS
+
+inline BOOL TokenIsSpace(wchar_t arg_c) {
+	return arg_c == 0 || arg_c == BOM || arg_c == 0x00A0 || iswspace(arg_c);
+}
+
+inline BOOL TokenIsWordChar(wchar_t arg_c) {
+	return arg_c == L'_' || iswalnum(arg_c);
+}
+
+inline BOOL TokenIsDoubleQuote(wchar_t arg_c) {
+	return arg_c == L'"' || arg_c == 0x201C || arg_c == 0x201D || arg_c == 0x201E || arg_c == 0x201F || arg_c == 0x00AB || arg_c == 0x00BB;
+}
+
+inline BOOL TokenIsSingleQuote(wchar_t arg_c) {
+	return arg_c == L'\'' || arg_c == L'`' || arg_c == 0x2018 || arg_c == 0x2019 || arg_c == 0x201A || arg_c == 0x201B || arg_c == 0x2039 || arg_c == 0x203A;
+}
+
+inline BOOL TokenIsDash(wchar_t arg_c) {
+	return arg_c == 0x2012 || arg_c == 0x2013 || arg_c == 0x2014 || arg_c == 0x2015;
+}
+
+// characters joining two parts of one token, e.g. "slovensko-český", "3,14", "www.sme.sk", "a/alebo"
+inline BOOL TokenIsInnerChar(wchar_t arg_prev, wchar_t arg_c, wchar_t arg_next) {
+	if (!TokenIsWordChar(arg_next))
+		return FALSE;
+	if (arg_c == L',')
+		return iswdigit(arg_prev) && iswdigit(arg_next);
+	return arg_c == L'-' || arg_c == L'/' || arg_c == L'.' || arg_c == L'\'' || arg_c == L'&' || arg_c == L'@';
+}
+
+BOOL TokenIsAbbreviation(const std::wstring &arg_word) {
+	int i;
+	std::wstring word = arg_word;
+	StringToLowerAlter(word);
+	// uppercase initials as in "J. Nováka", lowercase one-letter words (a, i, k, o, s, u, v, z) may end a sentence
+	if (arg_word.length() == 1 && iswupper(arg_word[0]))
+		return TRUE;
+	for (i = 0; _token_lib_gv_abbreviations[i]; ++i) {
+		if (word == _token_lib_gv_abbreviations[i])
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////  TOKENIZER
+
+// splits text into tokens, brackets, quotes, dashes and ellipses are normalized as in PTBTokenizer
+void TokenizeWords(const std::wstring &arg_text, std::vector<std::wstring> &arg_tokens, BOOL arg_ascii_quotes = TRUE) {
+	size_t i = 0, j, len = arg_text.length();
+	BOOL quote_open = FALSE, single_open = FALSE;
+	wchar_t c;
+	std::wstring word;
+
+	arg_tokens.clear();
+	while (i < len) {
+		c = arg_text[i];
+		if (TokenIsSpace(c)) {
+			++i;
+			continue;
+		}
+
+		// words, numbers with inner dots and commas, hyphenated words, urls
+		if (TokenIsWordChar(c)) {
+			j = i + 1;
+			while (j < len) {
+				if (TokenIsWordChar(arg_text[j]))
+					++j;
+				else if (j + 1 < len && TokenIsInnerChar(arg_text[j - 1], arg_text[j], arg_text[j + 1]))
+					j += 2;
+				else if (arg_text.compare(j, 3, L"://") == 0 && j + 3 < len && !TokenIsSpace(arg_text[j + 3])) {
+					while (j < len && !TokenIsSpace(arg_text[j]))
+						++j;
+					while (j > i && wcschr(L".,;:!?)]}\"'", arg_text[j - 1]))
+						--j;
+				}
+				else
+					break;
+			}
+			word = arg_text.substr(i, j - i);
+			i = j;
+			// period of an abbreviation belongs to the word, unless it ends the text
+			if (i < len && arg_text[i] == L'.' && arg_text.compare(i, 3, L"...") != 0 && TokenIsAbbreviation(word)) {
+				arg_tokens.push_back(word + L".");
+				++i;
+				for (j = i; j < len && TokenIsSpace(arg_text[j]); ++j);
+				if (j == len)
+					arg_tokens.push_back(L".");
+			}
+			else
+				arg_tokens.push_back(word);
+			continue;
+		}
+
+		// ellipsis
+		if (c == 0x2026 || arg_text.compare(i, 3, L"...") == 0) {
+			i += (c == 0x2026) ? 1 : 3;
+			while (i < len && arg_text[i] == L'.')
+				++i;
+			arg_tokens.push_back(L"...");
+			continue;
+		}
+
+		// dashes
+		if (TokenIsDash(c) || arg_text.compare(i, 2, L"--") == 0) {
+			i += (c == L'-') ? 2 : 1;
+			while (i < len && (arg_text[i] == L'-' || TokenIsDash(arg_text[i])))
+				++i;
+			arg_tokens.push_back(L"--");
+			continue;
+		}
+
+		// quotes, ascii or latex style (`` and '')
+		if (TokenIsDoubleQuote(c) || arg_text.compare(i, 2, L"``") == 0 || arg_text.compare(i, 2, L"''") == 0) {
+			i += TokenIsDoubleQuote(c) ? 1 : 2;
+			quote_open = !quote_open;
+			if (arg_ascii_quotes)
+				arg_tokens.push_back(L"\"");
+			else
+				arg_tokens.push_back(quote_open ? L"``" : L"''");
+			continue;
+		}
+		if (TokenIsSingleQuote(c)) {
+			++i;
+			single_open = !single_open;
+			if (arg_ascii_quotes)
+				arg_tokens.push_back(L"'");
+			else
+				arg_tokens.push_back(single_open ? L"`" : L"'");
+			continue;
+		}
+
+		// brackets
+		switch (c) {
+		case L'(': arg_tokens.push_back(L"-LRB-"); ++i; continue;
+		case L')': arg_tokens.push_back(L"-RRB-"); ++i; continue;
+		case L'[': arg_tokens.push_back(L"-LSB-"); ++i; continue;
+		case L']': arg_tokens.push_back(L"-RSB-"); ++i; continue;
+		case L'{': arg_tokens.push_back(L"-LCB-"); ++i; continue;
+		case L'}': arg_tokens.push_back(L"-RCB-"); ++i; continue;
+		case 0x00BD: arg_tokens.push_back(L"1/2"); ++i; continue;
+		case 0x00BC: arg_tokens.push_back(L"1/4"); ++i; continue;
+		case 0x00BE: arg_tokens.push_back(L"3/4"); ++i; continue;
+		}
+
+		// repeated ! and ? stay together, everything else is one symbol
+		if (c == L'!' || c == L'?') {
+			for (j = i + 1; j < len && (arg_text[j] == L'!' || arg_text[j] == L'?'); ++j);
+			arg_tokens.push_back(arg_text.substr(i, j - i));
+			i = j;
+			continue;
+		}
+		arg_tokens.push_back(std::wstring(1, c));
+		++i;
+	}
+}
+
+inline BOOL TokenIsSentenceBoundary(const std::wstring &arg_token) {
+	return arg_token == L"." || arg_token[0] == L'!' || arg_token[0] == L'?';
+}
+
+// closing brackets and quotes after the end of sentence still belong to it
+inline BOOL TokenIsSentenceFollower(const std::wstring &arg_token, BOOL arg_double_open, BOOL arg_single_open) {
+	return arg_token == L"-RRB-" || arg_token == L"-RSB-" || arg_token == L"-RCB-" || arg_token == L"''"
+		|| (arg_token == L"\"" && arg_double_open) || (arg_token == L"'" && arg_single_open);
+}
+
+// finds sentences as DocumentPreprocessor does; arg_ends[i] is one past the last token of i-th sentence
+// returns TRUE when the last sentence is complete (ends with a sentence boundary)
+BOOL TokenizeSentences(const std::vector<std::wstring> &arg_tokens, std::vector<size_t> &arg_ends) {
+	size_t i;
+	BOOL double_open = FALSE, single_open = FALSE, boundary = FALSE;
+
+	arg_ends.clear();
+	for (i = 0; i < arg_tokens.size(); ++i) {
+		const std::wstring &token = arg_tokens[i];
+		if (boundary && !TokenIsSentenceFollower(token, double_open, single_open)) {
+			arg_ends.push_back(i);
+			boundary = double_open = single_open = FALSE;
+		}
+		if (token == L"\"")
+			double_open = !double_open;
+		else if (token == L"``" || token == L"''")
+			double_open = token == L"``";
+		else if (token == L"'")
+			single_open = !single_open;
+		else if (token == L"`")
+			single_open = TRUE;
+		if (TokenIsSentenceBoundary(token))
+			boundary = TRUE;
+	}
+	if (!arg_tokens.empty() && (arg_ends.empty() || arg_ends.back() != arg_tokens.size()))
+		arg_ends.push_back(arg_tokens.size());
+	return boundary;
+}
+
+// TRUE when the text before arg_end ends a sentence; trailing spaces, closing quotes and brackets are skipped
+BOOL TokenIsSentenceEndAt(const std::wstring &arg_text, size_t arg_end) {
+	size_t start;
+	wchar_t c;
+
+	while (arg_end > 0) {
+		c = arg_text[arg_end - 1];
+		if (!TokenIsSpace(c) && !TokenIsDoubleQuote(c) && !TokenIsSingleQuote(c) && c != L')' && c != L']' && c != L'}')
+			break;
+		--arg_end;
+	}
+	if (arg_end == 0)
+		return FALSE;
+	c = arg_text[arg_end - 1];
+	if (c == L'!' || c == L'?' || c == 0x2026)
+		return TRUE;
+	if (c != L'.')
+		return FALSE;
+	// period of an abbreviation does not end the sentence
+	for (start = arg_end - 1; start > 0 && TokenIsWordChar(arg_text[start - 1]); --start);
+	return start == arg_end - 1 || !TokenIsAbbreviation(arg_text.substr(start, arg_end - 1 - start));
+}
+
+// tokenizes text into the format consumed by PreprocessText: token per line, empty line after sentence
+void TokenizeText(const std::wstring &arg_text, std::wstring &arg_output, BOOL arg_ascii_quotes = TRUE) {
+	size_t i, sentence;
+	std::vector<std::wstring> tokens;
+	std::vector<size_t> ends;
+
+	TokenizeWords(arg_text, tokens, arg_ascii_quotes);
+	TokenizeSentences(tokens, ends);
+	arg_output.clear();
+	for (i = 0, sentence = 0; i < tokens.size(); ++i) {
+		arg_output += tokens[i];
+		arg_output += L'\n';
+		if (i + 1 == ends[sentence]) {
+			arg_output += L'\n';
+			++sentence;
+		}
+	}
+}
+
+#endif
@@ -5,11 +5,22 @@
 
 #define FSEEK64 _fseeki64
 #define FTELL64 _ftelli64
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
 
 #else
 
 #define FSEEK64 fseeko64
 #define FTELL64 ftello64
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #endif
 
@@ -18,6 +29,7 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <float.h>
 #include <math.h>
 #include <atomic>
@@ -26,10 +38,26 @@
 #include <tuple>
 #include <deque>
 #include <queue>
+#include <vector>
+#include <string>
 #include <chrono>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
 #ifdef USE_OPENCL
 #include <CL/cl.h>
 #endif
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define VLIB_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define VLIB_TARGET(isa)
+#else
+#include <cpuid.h>
+#define VLIB_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
 
 #ifndef _VLIB_H
 #define _VLIB_H
@@ -40,19 +68,45 @@
 using namespace std;
 using namespace std::chrono;
 
+// indexed vector file written by write_vectors_indexed(), all parts are mapped as they are
+#define VLIB_INDEXED_MAGIC "VLIBIDX1"
+#define VLIB_ROW_ALIGNMENT 64
+
+struct vlib_indexed_header {
+	char magic[8];
+	int words, vsize, max_w, stride;	// stride: floats between rows, rows are VLIB_ROW_ALIGNMENT aligned
+	long long matrix_offset,			// words*stride floats
+		offsets_offset,					// words long longs, offset of every word in the pool
+		pool_offset, pool_size,			// words terminated by 0
+		index_offset, index_slots;		// hash table of word ids, -1 for empty slot, index_slots is power of 2
+};
+
 // global variables
-int words, vsize, max_w;
+int words, vsize, max_w, vstride;
 char *vocab = NULL;
 float *M = NULL;
-atomic<unsigned int> no_threads;
+// vocabulary as a pool of words with their offsets and hash index, vocab is NULL then; points into
+// the mapping of the indexed format or to the storage below for the other formats
+const long long *vocab_offsets = NULL;
+const char *vocab_pool = NULL;
+const int *word_index = NULL;
+long long word_index_slots = 0;
+vector<char> vocab_pool_data;
+vector<long long> vocab_offsets_data;
+// optional bloom filter rejecting most unknown words before the hash index, see build_word_filter()
+unsigned long long *word_filter = NULL;
+long long word_filter_bits = 0;
 high_resolution_clock::time_point time_point1, time_point2;
 float* _dummy = new float[1];
 long long *match_count = NULL, *volume_count = NULL;
+// imf() and idf() of every word, computed by read_counts()
+float *imf_weights = NULL, *idf_weights = NULL;
 const long long total_match_count = 117631602601;
 const long long total_page_count = 602551512;
 const long long total_volume_count = 1136254;
-int **cache_results;
-float **cache_distances;
+// mapping of the vector file when M points into it, see map_vectors()
+void *mapped_file = NULL;
+size_t mapped_size = 0;
 
 struct Phrase {
 	int beginPosition,
@@ -108,6 +162,348 @@ char *readFile(const char*filename, size_t *_size = NULL) {
 	return content;
 }
 
+inline char* get_word(int id, char *s = NULL) {
+	char *word = vocab_offsets ? (char*)vocab_pool + vocab_offsets[id] : vocab + (long long)id*max_w;
+	if (s) strcpy(s, word);
+	else return word;
+	return s;
+}
+
+// FNV-1a hash of the word
+inline unsigned long long hash_word(const char *s) {
+	unsigned long long h = 14695981039346656037ULL;
+	for (;*s;++s) {
+		h ^= (unsigned char)*s;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// bit positions of the word in the bloom filter, both come from one hash
+inline bool word_filter_test(unsigned long long h) {
+	unsigned long long a = h&(word_filter_bits - 1), b = (h >> 32)&(word_filter_bits - 1);
+	return (word_filter[a >> 6] >> (a & 63)) & (word_filter[b >> 6] >> (b & 63)) & 1;
+}
+
+// word id from the hash index, -1 for unknown word
+inline int find_word_hashed(const char *s) {
+	unsigned long long h = hash_word(s);
+	if (word_filter && !word_filter_test(h)) return -1;
+	for (long long slot = h&(word_index_slots - 1);word_index[slot] != -1;slot = (slot + 1)&(word_index_slots - 1)) {
+		if (!strcmp(s, get_word(word_index[slot]))) return word_index[slot];
+	}
+	return -1;
+}
+
+// word id by binary search of the sorted vocabulary, or from the hash index if there is one
+inline int find_word(const char *s) {
+	if (word_index) return find_word_hashed(s);
+	int a = 0, b = words, mid, cmp;
+	while (a<b) {
+		mid = (a + b) / 2;
+		cmp = strcmp(s, get_word(mid));
+		if (!cmp) return mid;
+		if (cmp>0) a = mid + 1;
+		else b = mid;
+	}
+	return -1;
+}
+
+// builds the hash index of the vocabulary with load factor at most 1/2
+void build_word_index(int* &index, long long &slots) {
+	slots = 1;
+	while (slots<2 * (long long)words) slots *= 2;
+	index = (int*)malloc(slots*sizeof(int));
+	if (!index) err("Failed to allocate memory for word index\n");
+	memset(index, -1, slots*sizeof(int));
+	for (int i = 0;i<words;++i) {
+		long long slot = hash_word(get_word(i))&(slots - 1);
+		while (index[slot] != -1) slot = (slot + 1)&(slots - 1);
+		index[slot] = i;
+	}
+}
+
+// filter with bits_per_word bits for every word, unknown words pass it with probability about
+// (1 - e^(-2/bits_per_word))^2, 5% for the default; it saves the probe of the hash index for them
+void build_word_filter(int bits_per_word = 8) {
+	word_filter_bits = 64;
+	while (word_filter_bits<bits_per_word*(long long)words) word_filter_bits *= 2;
+	free(word_filter);
+	word_filter = (unsigned long long*)calloc(word_filter_bits / 64, sizeof(unsigned long long));
+	if (!word_filter) err("Failed to allocate memory for word filter\n");
+	for (int i = 0;i<words;++i) {
+		unsigned long long h = hash_word(get_word(i)), a = h&(word_filter_bits - 1), b = (h >> 32)&(word_filter_bits - 1);
+		word_filter[a >> 6] |= 1ULL << (a & 63);
+		word_filter[b >> 6] |= 1ULL << (b & 63);
+	}
+}
+
+// phrases of the vocabulary are words joined by '_'; the trie of the vocabulary cut at these joints finds
+// all entries starting at a position of a phrase in one walk: its nodes are the prefixes of entries
+// before a '_', kept in a hash table under the hash_word() of the prefix, so the walk extends one FNV-1a
+// hash by the characters of the phrase, probes word_index for an entry at every space or '_' and goes
+// on only while the trie has the prefix; spaces of the phrase match '_' of the vocabulary
+struct phrase_trie_node {
+	unsigned long long hash;
+	int word, length;	// word continuing the prefix of length characters with '_', -1 for empty slot
+};
+
+namespace _phrase_trie {
+	vector<phrase_trie_node> nodes;		// power of 2 slots
+	atomic<bool> built(false);
+	mutex build_lock;
+}
+
+// the trie of the previous vocabulary is built again on the next phrase
+inline void phrase_trie_reset() {
+	_phrase_trie::built = false;
+}
+
+// first n characters of the phrase span equal to the word, space of the span stands for '_'
+inline bool phrase_span_equals(const char *span, int n, const char *word) {
+	for (int i = 0;i<n;++i) {
+		if ((span[i] == ' ' ? '_' : span[i]) != word[i]) return false;
+	}
+	return true;
+}
+
+void build_phrase_trie() {
+	using namespace _phrase_trie;
+	lock_guard<mutex> guard(build_lock);
+	if (built) return;
+	vector<phrase_trie_node> prefixes;
+	for (int i = 0;i<words;++i) {
+		const char *word = get_word(i);
+		unsigned long long h = 14695981039346656037ULL;
+		for (int j = 0;word[j];++j) {
+			if (word[j] == '_') prefixes.push_back({ h, i, j });
+			h ^= (unsigned char)word[j];
+			h *= 1099511628211ULL;
+		}
+	}
+	long long slots = 1;
+	while (slots<2 * (long long)prefixes.size()) slots *= 2;
+	nodes.assign(slots, { 0, -1, 0 });
+	for (const phrase_trie_node &prefix : prefixes) {
+		long long slot = prefix.hash&(slots - 1);
+		for (;nodes[slot].word != -1;slot = (slot + 1)&(slots - 1)) {
+			const phrase_trie_node &node = nodes[slot];
+			if (node.hash == prefix.hash && node.length == prefix.length && !strncmp(get_word(node.word), get_word(prefix.word), prefix.length)) break;
+		}
+		if (nodes[slot].word == -1) nodes[slot] = prefix;
+	}
+	built = true;
+}
+
+// word id of the span of n characters with hash h, -1 for unknown span
+inline int find_phrase_span(const char *span, int n, unsigned long long h) {
+	if (word_filter && !word_filter_test(h)) return -1;
+	for (long long slot = h&(word_index_slots - 1);word_index[slot] != -1;slot = (slot + 1)&(word_index_slots - 1)) {
+		const char *word = get_word(word_index[slot]);
+		if (phrase_span_equals(span, n, word) && !word[n]) return word_index[slot];
+	}
+	return -1;
+}
+
+// whether an entry of the vocabulary continues the span of n characters with hash h by '_'
+inline bool phrase_trie_has(const char *span, int n, unsigned long long h) {
+	using namespace _phrase_trie;
+	long long slots = nodes.size();
+	for (long long slot = h&(slots - 1);nodes[slot].word != -1;slot = (slot + 1)&(slots - 1)) {
+		const phrase_trie_node &node = nodes[slot];
+		if (node.hash == h && node.length == n && phrase_span_equals(span, n, get_word(node.word))) return true;
+	}
+	return false;
+}
+
+struct phrase_match {
+	int end, id;		// position after the entry and the space or '_' following it, word id
+};
+
+// entries of the vocabulary in the phrase s of len characters starting at position a, shortest first;
+// returns whether the first word of s + a alone is an entry
+bool phrase_matches(const char *s, int len, int a, vector<phrase_match> &matches) {
+	if (!_phrase_trie::built) build_phrase_trie();
+	unsigned long long h = 14695981039346656037ULL;
+	bool first = true, found = false;
+	matches.clear();
+	for (int b = a;;++b) {
+		if (b == len || s[b] == ' ' || s[b] == '_') {
+			if (b>a) {
+				int id = find_phrase_span(s + a, b - a, h);
+				if (id >= 0) matches.push_back({ b == len ? len : b + 1, id });
+				if (first) found = id >= 0;
+				first = false;
+			}
+			if (b == len || !phrase_trie_has(s + a, b - a, h)) break;
+		}
+		h ^= (unsigned char)(s[b] == ' ' ? '_' : s[b]);
+		h *= 1099511628211ULL;
+	}
+	return found;
+}
+
+// loaders add words of the vocabulary to the pool one by one
+void begin_vocab(int count) {
+	vocab_pool_data.clear();
+	vocab_offsets_data.clear();
+	vocab_offsets_data.reserve(count);
+	vocab_pool_data.reserve(count * 8LL);
+}
+
+inline void add_vocab_word(const char *s, size_t len) {
+	vocab_offsets_data.push_back(vocab_pool_data.size());
+	vocab_pool_data.insert(vocab_pool_data.end(), s, s + len);
+	vocab_pool_data.push_back(0);
+}
+
+// publishes the pool and builds its hash index, the padded vocab array is not kept
+void end_vocab() {
+	int *index;
+	free(vocab);
+	vocab = NULL;
+	vocab_pool_data.shrink_to_fit();
+	vocab_pool = vocab_pool_data.data();
+	vocab_offsets = vocab_offsets_data.data();
+	build_word_index(index, word_index_slots);
+	word_index = index;
+	phrase_trie_reset();
+}
+
+// k-NN cache shared by all threads: entries of k results and distances live in a slab of fixed
+// capacity; cache_slots maps every word to its entry, readers copy an entry without locks and check
+// its version afterwards, one thread computes a missing word while the others wait for it; a full
+// slab replaces the least used of VLIB_CACHE_SAMPLE entries under the clock hand, whose counts are halved
+#define VLIB_CACHE_CAPACITY_DEFAULT 65536
+#define VLIB_CACHE_FILLING -2
+#define VLIB_CACHE_SAMPLE 8
+
+struct cache_entry {
+	atomic<unsigned int> version;		// odd while the entry is written
+	atomic<int> owner;
+	atomic<unsigned int> hits;
+};
+
+atomic<int> *cache_slots = NULL;		// entry of every word, -1 or VLIB_CACHE_FILLING
+cache_entry *cache_entries = NULL;
+int *cache_entry_results = NULL;
+float *cache_entry_distances = NULL;
+int cache_k = 0, cache_capacity = VLIB_CACHE_CAPACITY_DEFAULT, cache_used = 0, cache_hand = 0;
+mutex cache_lock;
+condition_variable cache_filled;
+
+void cache_file_append(int id, int k, const int *results, const float *distances);
+
+// empties the cache for a new vocabulary, the slab is allocated by the first stored word
+void cache_reset() {
+	lock_guard<mutex> guard(cache_lock);
+	delete[] cache_slots;
+	delete[] cache_entries;
+	free(cache_entry_results);
+	free(cache_entry_distances);
+	cache_slots = new atomic<int>[words];
+	for (int i = 0;i<words;++i) cache_slots[i].store(-1, memory_order_relaxed);
+	cache_entries = NULL;
+	cache_entry_results = NULL;
+	cache_entry_distances = NULL;
+	cache_k = cache_used = cache_hand = 0;
+}
+
+// copies the first k results of word id, false if it is not cached
+inline bool cache_lookup(int id, int k, int *results, float *distances) {
+	if (id<0 || !cache_slots) return false;
+	int slot = cache_slots[id].load(memory_order_acquire);
+	if (slot<0 || k>cache_k) return false;
+	cache_entry &entry = cache_entries[slot];
+	unsigned int version = entry.version.load(memory_order_acquire);
+	if ((version & 1) || entry.owner.load(memory_order_relaxed) != id) return false;
+	memcpy(results, cache_entry_results + (long long)slot*cache_k, sizeof(int)*k);
+	memcpy(distances, cache_entry_distances + (long long)slot*cache_k, sizeof(float)*k);
+	atomic_thread_fence(memory_order_acquire);
+	if (entry.version.load(memory_order_relaxed) != version) return false;
+	entry.hits.fetch_add(1, memory_order_relaxed);
+	return true;
+}
+
+// reserves word id for the calling thread to compute, false if it is cached or being computed
+inline bool cache_claim(int id) {
+	int expected = -1;
+	return cache_slots && id >= 0 && cache_slots[id].compare_exchange_strong(expected, VLIB_CACHE_FILLING);
+}
+
+// entry for a new word, cache_lock is held
+int cache_take_entry() {
+	if (cache_used<cache_capacity) return cache_used++;
+	int victim = -1;
+	for (int i = 0;i<VLIB_CACHE_SAMPLE;++i, cache_hand = (cache_hand + 1) % cache_capacity) {
+		unsigned int hits = cache_entries[cache_hand].hits.load(memory_order_relaxed);
+		if (victim<0 || hits<cache_entries[victim].hits.load(memory_order_relaxed)) victim = cache_hand;
+		cache_entries[cache_hand].hits.store(hits / 2, memory_order_relaxed);
+	}
+	int owner = cache_entries[victim].owner.load(memory_order_relaxed);
+	if (owner >= 0) cache_slots[owner].store(-1, memory_order_release);
+	return victim;
+}
+
+// writes results of a claimed word and wakes the threads waiting for it; the claim is only released
+// when k differs from the cache
+void cache_store(int id, int k, const int *results, const float *distances, unsigned int hits = 1) {
+	if (id<0 || !cache_slots) return;
+	{
+		lock_guard<mutex> guard(cache_lock);
+		if (!cache_entries && cache_capacity>0) {
+			cache_k = k;
+			cache_entries = new cache_entry[cache_capacity];
+			for (int i = 0;i<cache_capacity;++i) {
+				cache_entries[i].version.store(0, memory_order_relaxed);
+				cache_entries[i].owner.store(-1, memory_order_relaxed);
+				cache_entries[i].hits.store(0, memory_order_relaxed);
+			}
+			cache_entry_results = (int*)malloc((long long)cache_capacity*k*sizeof(int));
+			cache_entry_distances = (float*)malloc((long long)cache_capacity*k*sizeof(float));
+			if (!cache_entry_results || !cache_entry_distances) err("Failed to allocate memory for cache\n");
+		}
+		if (!cache_entries || k != cache_k) {
+			cache_slots[id].store(-1, memory_order_release);
+		}
+		else {
+			int slot = cache_take_entry();
+			cache_entry &entry = cache_entries[slot];
+			entry.version.fetch_add(1, memory_order_acq_rel);
+			atomic_thread_fence(memory_order_release);
+			memcpy(cache_entry_results + (long long)slot*k, results, sizeof(int)*k);
+			memcpy(cache_entry_distances + (long long)slot*k, distances, sizeof(float)*k);
+			entry.owner.store(id, memory_order_relaxed);
+			entry.hits.store(hits, memory_order_relaxed);
+			entry.version.fetch_add(1, memory_order_release);
+			cache_slots[id].store(slot, memory_order_release);
+			cache_file_append(id, k, results, distances);
+		}
+	}
+	cache_filled.notify_all();
+}
+
+// results of word id from the cache, or computed by compute() once for all threads asking for it;
+// returns k for cached words and what compute() returns otherwise
+template<class F> int cache_get(int id, int k, int *results, float *distances, F compute) {
+	if (id<0 || !cache_slots) return compute();
+	for (;;) {
+		if (cache_lookup(id, k, results, distances)) return k;
+		if (cache_claim(id)) {
+			int n = compute();
+			cache_store(id, k, results, distances);
+			return n;
+		}
+		int slot = cache_slots[id].load(memory_order_acquire);
+		if (slot == VLIB_CACHE_FILLING) {
+			unique_lock<mutex> guard(cache_lock);
+			cache_filled.wait(guard, [&] { return cache_slots[id].load(memory_order_acquire) != VLIB_CACHE_FILLING; });
+		}
+		// other k than the cache has
+		else if (slot >= 0 && k>cache_k) return compute();
+	}
+}
+
 void read_vectors(const char *filename = "corpus.bin", int *_words = &words, int *_size = &vsize, int *_max_w = &max_w, char **_vocab = &vocab, float **_M = &M) {
 	long long ret;
 	FILE *f = fopen(filename, "rb");
@@ -145,24 +541,325 @@ void read_vectors(const char *filename = "corpus.bin", int *_words = &words, int
 			last = clock();
 		}
 	}
-	*_vocab = (char*)malloc(*_words * *_max_w *sizeof(char));
+	char *word = (char*)malloc(*_max_w *sizeof(char));
+	begin_vocab(*_words);
 	for (int i = 0;i<*_words;++i) {
-		fscanf(f, "%s\n", *_vocab + i * *_max_w);
+		fscanf(f, "%s\n", word);
+		add_vocab_word(word, strlen(word));
 		if (i % 100000 == 0 && clock() - last>CLOCKS_PER_SEC*.5) {
 			size_t pos = FTELL64(f);
 			fprintf(stderr, "Reading file %s...%.2f%%\r", filename, pos*100. / file_size);
 			last = clock();
 		}
 	}
+	free(word);
 	fclose(f);
 	fprintf(stderr, "Reading file %s...100.00%%\n", filename);
 	words = *_words;
 	vsize = *_size;
+	vstride = vsize;
 	max_w = *_max_w;
-	vocab = *_vocab;
+	*_vocab = NULL;
+	end_vocab();
 	M = *_M;
-	cache_results = (int**)calloc(words, sizeof(int*));
-	cache_distances = (float**)calloc(words, sizeof(float*));
+	cache_reset();
+}
+
+// whether the file is in the indexed format of write_vectors_indexed(), such file is always mapped
+int is_vectors_indexed(const char *filename) {
+	char magic[8];
+	FILE *f = fopen(filename, "rb");
+	if (!f) err("Cannot open file: %s\n", filename);
+	int ret = fread(magic, 1, 8, f) == 8 && !memcmp(magic, VLIB_INDEXED_MAGIC, 8);
+	fclose(f);
+	return ret;
+}
+
+// maps the whole file read-only, see map_vectors() for huge_pages and prefault
+char *map_file(const char *filename, size_t &file_size, int huge_pages = 0, int prefault = 0) {
+	char *base;
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) err("Cannot open file: %s\n", filename);
+	LARGE_INTEGER _file_size;
+	if (!GetFileSizeEx(file, &_file_size)) err("Cannot get file size: %s\n", filename);
+	file_size = (size_t)_file_size.QuadPart;
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping) err("Cannot map file: %s\n", filename);
+	base = (char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!base) err("Cannot map file: %s\n", filename);
+	// the view keeps the file mapped
+	CloseHandle(mapping);
+	CloseHandle(file);
+	// large pages are available only for memory backed by the paging file
+	(void)huge_pages;
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd<0) err("Cannot open file: %s\n", filename);
+	struct stat st;
+	if (fstat(fd, &st)) err("Cannot get file size: %s\n", filename);
+	file_size = st.st_size;
+	int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if (prefault) flags |= MAP_POPULATE;
+#endif
+	base = (char*)mmap(NULL, file_size, PROT_READ, flags, fd, 0);
+	if (base == MAP_FAILED) err("Cannot map file: %s\n", filename);
+	close(fd);
+#ifdef MADV_HUGEPAGE
+	if (huge_pages) madvise(base, file_size, MADV_HUGEPAGE);
+#endif
+#endif
+	return base;
+}
+
+void unmap_file(char *base, size_t file_size) {
+#ifdef _WIN32
+	(void)file_size;
+	UnmapViewOfFile(base);
+#else
+	munmap(base, file_size);
+#endif
+}
+
+// maps the vector file instead of reading it, M points into the mapping and its pages are shared through
+// the page cache by all processes using the same file; only the vocabulary is copied to private memory
+// huge_pages: asks the kernel to back the mapping with transparent huge pages (ignored where unsupported)
+// prefault: reads the whole matrix in now instead of on the first access of every page
+void map_vectors(const char *filename = "corpus.bin", int huge_pages = 0, int prefault = 0) {
+	size_t file_size;
+	char *base;
+	fprintf(stderr, "Mapping file %s...", filename);
+	base = map_file(filename, file_size, huge_pages, prefault);
+	mapped_file = base;
+	mapped_size = file_size;
+	if (file_size >= sizeof(vlib_indexed_header) && !memcmp(base, VLIB_INDEXED_MAGIC, 8)) {
+		// indexed format needs only pointers into the mapping
+		const vlib_indexed_header *header = (const vlib_indexed_header*)base;
+		if ((size_t)(header->index_offset + header->index_slots*sizeof(int))>file_size) err("Read error: %s is too short\n", filename);
+		words = header->words;
+		vsize = header->vsize;
+		vstride = header->stride;
+		max_w = header->max_w;
+		M = (float*)(base + header->matrix_offset);
+		vocab = NULL;
+		vocab_offsets = (const long long*)(base + header->offsets_offset);
+		vocab_pool = base + header->pool_offset;
+		word_index = (const int*)(base + header->index_offset);
+		word_index_slots = header->index_slots;
+		phrase_trie_reset();
+		if (prefault) {
+			volatile float sink = 0;
+			for (long long i = 0;i<words*(long long)vstride;i += 4096 / sizeof(float)) sink = sink + M[i];
+		}
+		fprintf(stderr, "ok\n");
+		cache_reset();
+		return;
+	}
+	if (file_size<3 * sizeof(int)) err("Read error: %s is too short\n", filename);
+	memcpy(&words, base, sizeof(int));
+	memcpy(&vsize, base + sizeof(int), sizeof(int));
+	memcpy(&max_w, base + 2 * sizeof(int), sizeof(int));
+	long long total = words*(long long)vsize;
+	if (words<0 || vsize<0 || max_w<1 || file_size<3 * sizeof(int) + total*sizeof(float)) err("Read error: %s is too short\n", filename);
+	vstride = vsize;
+	M = (float*)(base + 3 * sizeof(int));
+	if (prefault) {
+		// touching one float per page faults the pages in where MAP_POPULATE is missing
+		volatile float sink = 0;
+		for (long long i = 0;i<total;i += 4096 / sizeof(float)) sink = sink + M[i];
+	}
+	// vocabulary follows the matrix, words are separated by white space as fscanf("%s") reads them
+	const char *p = base + 3 * sizeof(int) + total*sizeof(float), *end = base + file_size, *word;
+	begin_vocab(words);
+	for (int i = 0;i<words;++i) {
+		while (p<end && isspace((unsigned char)*p)) ++p;
+		for (word = p;p<end && !isspace((unsigned char)*p);++p);
+		add_vocab_word(word, p - word);
+	}
+	end_vocab();
+	fprintf(stderr, "ok\n");
+	cache_reset();
+}
+
+// k-NN cache kept in a file between runs: header and records of one word id with hit count, k results
+// and k distances; the file is loaded into the cache and records of words missing in it are appended;
+// the hit counts of its records are updated at exit, or when it grows over its size limit, it is
+// rewritten with the most used entries fitting into 3/4 of it
+#define VLIB_CACHE_MAGIC "VLIBKNC1"
+
+struct vlib_cache_header {
+	char magic[8];
+	int words, k;
+	unsigned long long fingerprint;		// of the vectors the results come from
+};
+
+string cache_file_name;
+FILE *cache_file = NULL;
+size_t cache_file_size = 0, cache_file_max = 0;
+int cache_file_k = 0;
+bool cache_file_rewrite = false;
+vector<int> cache_file_records;		// record of every word in the file, -1 for none
+
+inline size_t cache_record_size(int k) {
+	return 2 * sizeof(int) + k*(sizeof(int) + sizeof(float));
+}
+
+// identifies the vector file by its size and a sample of words and vectors
+unsigned long long cache_fingerprint() {
+	unsigned long long h = hash_word("") ^ ((unsigned long long)words << 32 | vsize);
+	int step = max(1, words / 1024);
+	for (int i = 0;i<words;i += step) {
+		h = h * 1099511628211ULL ^ hash_word(get_word(i));
+		if (M) {
+			unsigned int bits;
+			memcpy(&bits, M + (long long)i*vstride, sizeof(bits));
+			h = h * 1099511628211ULL ^ bits;
+		}
+	}
+	return h;
+}
+
+// hash of every word of the vocabulary, for files that keep word ids without the vectors
+unsigned long long vocab_fingerprint() {
+	unsigned long long h = hash_word("") ^ (unsigned long long)words;
+	for (int i = 0;i<words;++i) h = h * 1099511628211ULL ^ hash_word(get_word(i));
+	return h;
+}
+
+void cache_file_write_record(FILE *f, int id, unsigned int hits, const int *results, const float *distances, int k) {
+	fwrite(&id, sizeof(int), 1, f);
+	fwrite(&hits, sizeof(int), 1, f);
+	fwrite(results, sizeof(int), k, f);
+	fwrite(distances, sizeof(float), k, f);
+}
+
+// appends the results of word id, sets cache_file_rewrite when the file reaches its limit; cache_lock is held
+void cache_file_append(int id, int k, const int *results, const float *distances) {
+	if (!cache_file || k != cache_file_k || cache_file_rewrite || cache_file_records[id] >= 0) return;
+	if (cache_file_size + cache_record_size(k)>cache_file_max) {
+		cache_file_rewrite = true;
+		return;
+	}
+	cache_file_records[id] = (int)((cache_file_size - sizeof(vlib_cache_header)) / cache_record_size(k));
+	cache_file_write_record(cache_file, id, 0, results, distances, k);
+	cache_file_size += cache_record_size(k);
+}
+
+// writes back the file if it is over its limit or damaged, keeping the most used entries; otherwise only
+// the hit counts of the cached words are written into their records
+void close_cache_file() {
+	if (cache_file_name.empty()) return;
+	lock_guard<mutex> guard(cache_lock);
+	if (cache_file) fclose(cache_file);
+	cache_file = NULL;
+	if (!cache_file_rewrite && cache_entries && cache_k == cache_file_k) {
+		vector<pair<int, unsigned int>> hits;
+		for (int i = 0;i<cache_used;++i) {
+			int owner = cache_entries[i].owner.load(memory_order_relaxed);
+			if (owner >= 0 && cache_slots[owner].load(memory_order_relaxed) == i && cache_file_records[owner] >= 0)
+				hits.push_back(make_pair(cache_file_records[owner], cache_entries[i].hits.load(memory_order_relaxed)));
+		}
+		sort(hits.begin(), hits.end());
+		FILE *f = fopen(cache_file_name.c_str(), "r+b");
+		if (f) {
+			for (size_t j = 0;j<hits.size();++j) {
+				fseek(f, (long)(sizeof(vlib_cache_header) + hits[j].first*cache_record_size(cache_file_k) + sizeof(int)), SEEK_SET);
+				fwrite(&hits[j].second, sizeof(int), 1, f);
+			}
+			fclose(f);
+		}
+	}
+	else if (cache_file_rewrite && cache_k == cache_file_k) {
+		int k = cache_file_k;
+		vector<int> slots;
+		for (int i = 0;i<cache_used;++i) {
+			int owner = cache_entries[i].owner.load(memory_order_relaxed);
+			if (owner >= 0 && cache_slots[owner].load(memory_order_relaxed) == i) slots.push_back(i);
+		}
+		stable_sort(slots.begin(), slots.end(), [](int a, int b) {
+			return cache_entries[a].hits.load(memory_order_relaxed)>cache_entries[b].hits.load(memory_order_relaxed);
+		});
+		size_t keep = min(slots.size(), (cache_file_max * 3 / 4 - sizeof(vlib_cache_header)) / cache_record_size(k));
+		FILE *f = fopen(cache_file_name.c_str(), "wb");
+		if (f) {
+			vlib_cache_header header;
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, VLIB_CACHE_MAGIC, 8);
+			header.words = words;
+			header.k = k;
+			header.fingerprint = cache_fingerprint();
+			fwrite(&header, sizeof(header), 1, f);
+			for (size_t j = 0;j<keep;++j) {
+				cache_entry &entry = cache_entries[slots[j]];
+				cache_file_write_record(f, entry.owner.load(memory_order_relaxed), entry.hits.load(memory_order_relaxed) / 2,
+					cache_entry_results + (long long)slots[j] * k, cache_entry_distances + (long long)slots[j] * k, k);
+			}
+			fclose(f);
+		}
+	}
+	cache_file_name.clear();
+}
+
+// opens the cache file for results of k neighbours limited to max_bytes, a file of other vectors or k
+// is replaced; its most used records are loaded into the cache
+void open_cache_file(const char *filename, int k, size_t max_bytes) {
+	vlib_cache_header header;
+	size_t record = cache_record_size(k), mapped;
+	if (!cache_slots || cache_capacity <= 0) return;
+	cache_file_name = filename;
+	cache_file_k = k;
+	cache_file_max = max(max_bytes, sizeof(header) + record);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VLIB_CACHE_MAGIC, 8);
+	header.words = words;
+	header.k = k;
+	header.fingerprint = cache_fingerprint();
+
+	FILE *f = fopen(filename, "rb");
+	vlib_cache_header stored;
+	bool valid = f && fread(&stored, sizeof(stored), 1, f) == 1 && !memcmp(&stored, &header, sizeof(header));
+	if (f) fclose(f);
+	if (!valid) {
+		f = fopen(filename, "wb");
+		if (!f) err("Cannot create file: %s\n", filename);
+		fwrite(&header, sizeof(header), 1, f);
+		fclose(f);
+	}
+	fprintf(stderr, "Mapping file %s...", filename);
+	char *base = map_file(filename, mapped);
+	cache_file_size = mapped;
+	size_t records = (mapped - sizeof(header)) / record;
+	// a record cut by a crash would misalign the appended ones
+	if (sizeof(header) + records*record != mapped || mapped>cache_file_max) cache_file_rewrite = true;
+	vector<pair<unsigned int, size_t>> order;
+	cache_file_records.assign(words, -1);
+	for (size_t i = 0;i<records;++i) {
+		unsigned int hits;
+		int id;
+		memcpy(&id, base + sizeof(header) + i*record, sizeof(int));
+		memcpy(&hits, base + sizeof(header) + i*record + sizeof(int), sizeof(int));
+		order.push_back(make_pair(hits, i));
+		if (id >= 0 && id<words && cache_file_records[id]<0) cache_file_records[id] = (int)i;
+	}
+	// most used records first, the rest would be replaced anyway
+	stable_sort(order.begin(), order.end(), [](const pair<unsigned int, size_t> &a, const pair<unsigned int, size_t> &b) { return a.first>b.first; });
+	if (order.size()>(size_t)cache_capacity) order.resize(cache_capacity);
+	vector<int> results(k);
+	vector<float> distances(k);
+	for (size_t i = 0;i<order.size();++i) {
+		const char *p = base + sizeof(header) + order[i].second*record;
+		int id;
+		memcpy(&id, p, sizeof(int));
+		memcpy(results.data(), p + 2 * sizeof(int), k*sizeof(int));
+		memcpy(distances.data(), p + 2 * sizeof(int) + k*sizeof(int), k*sizeof(float));
+		if (id >= 0 && id<words && cache_claim(id)) cache_store(id, k, results.data(), distances.data(), order[i].first);
+	}
+	unmap_file(base, mapped);
+	fprintf(stderr, "%llu words\n", (unsigned long long)records);
+	cache_file = fopen(filename, "ab");
+	if (!cache_file) err("Cannot open file: %s\n", filename);
+	atexit(close_cache_file);
 }
 
 void read_vocab(const char*filename = "corpus.bin", int *_words = &words, int *_size = &vsize, int *_max_w = &max_w, char **_vocab = &vocab) {
@@ -175,16 +872,21 @@ void read_vocab(const char*filename = "corpus.bin", int *_words = &words, int *_
 	long long floats = *_words*(long long)*_size;
 	if ((ret = FSEEK64(f, 3 * sizeof(int) + floats*sizeof(float), SEEK_SET))) err("Error %d: Cannot set position in file\n", ret);
 	fprintf(stderr, "Reading file %s...", filename);
-	*_vocab = (char*)malloc(*_words * *_max_w *sizeof(char));
+	char *word = (char*)malloc(*_max_w *sizeof(char));
+	begin_vocab(*_words);
 	for (int i = 0;i<*_words;++i) {
-		fscanf(f, "%s\n", *_vocab + i * *_max_w);
+		fscanf(f, "%s\n", word);
+		add_vocab_word(word, strlen(word));
 	}
+	free(word);
 	fclose(f);
 	fprintf(stderr, "ok\n");
 	words = *_words;
 	vsize = *_size;
+	vstride = vsize;
 	max_w = *_max_w;
-	vocab = *_vocab;
+	*_vocab = NULL;
+	end_vocab();
 	M = NULL;
 }
 
@@ -193,87 +895,398 @@ void read_counts(const char *filename = "counts2.bin") {
 	FILE *f = fopen(filename, "rb");
 	if (!f) err("Cannot open file: %s\n", filename);
 	fprintf(stderr, "Reading file %s...", filename);
+	free(match_count);
+	free(volume_count);
+	free(imf_weights);
+	free(idf_weights);
 	match_count = (long long*)malloc(words*sizeof(long long));
 	if (!match_count) err("Failed to allocate memory for match_count\n");
 	volume_count = (long long*)malloc(words*sizeof(long long));
 	if (!volume_count) err("Failed to allocate memory for volume_count\n");
+	imf_weights = (float*)malloc(words*sizeof(float));
+	idf_weights = (float*)malloc(words*sizeof(float));
+	if (!imf_weights || !idf_weights) err("Failed to allocate memory for the weights\n");
+	if ((ret = fread(match_count, sizeof(long long), words, f))<words) err("Read error: %d\n", ret);
+	if ((ret = fread(volume_count, sizeof(long long), words, f))<words) err("Read error: %d\n", ret);
+	fclose(f);
+	// the integer division of the counts is kept as it was when the weights were computed per query
 	for (int i = 0;i<words;++i) {
-		if ((ret = fread(match_count + i, sizeof(long long), 1, f))<1) err("Read error: %d\n", ret);
-	}
-	for (int i = 0;i<words;++i) {
-		if ((ret = fread(volume_count + i, sizeof(long long), 1, f))<1) err("Read error: %d\n", ret);
+		imf_weights[i] = log(total_match_count / (1 + match_count[i]));
+		idf_weights[i] = log(total_volume_count / (1 + volume_count[i]));
 	}
-	fclose(f);
 	fprintf(stderr, "ok\n");
 }
 
 inline float imf(int v) {
-	return log(total_match_count / (1 + match_count[v]));
+	return imf_weights[v];
 }
 
 inline float idf(int v) {
-	return log(total_volume_count / (1 + volume_count[v]));
+	return idf_weights[v];
 }
 
-inline float dot(int v1, int v2) {
-	float res = 0, *a = M + v1*vsize, *b = M + v2*vsize;
-	for (int i = 0;i<vsize;++i) {
-		res += *a++* *b++;
+// dot product kernels, dot_kernel is the fastest one the cpu supports that agrees with the scalar one
+float dot_scalar(const float *a, const float *b, int n) {
+	float res = 0;
+	for (int i = 0;i<n;++i) {
+		res += a[i] * b[i];
 	}
 	return res;
 }
 
-inline float dot(const int v1, float *v2) {
-	float res = 0, *a = M + v1*vsize;
-	for (int i = 0;i<vsize;++i) {
-		res += *a++* *v2++;
+#ifdef VLIB_X86
+VLIB_TARGET("sse") float dot_sse(const float *a, const float *b, int n) {
+	__m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+	int i = 0;
+	for (;i + 8 <= n;i += 8) {
+		s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+	}
+	s0 = _mm_add_ps(s0, s1);
+	s0 = _mm_add_ps(s0, _mm_movehl_ps(s0, s0));
+	s0 = _mm_add_ss(s0, _mm_shuffle_ps(s0, s0, 1));
+	float res = _mm_cvtss_f32(s0);
+	for (;i<n;++i) res += a[i] * b[i];
+	return res;
+}
+
+// horizontal sums of the lanes; the AVX-512 kernels add their two halves first, extracted with a zero
+// mask because the unmasked extracts and casts of GCC leave an undefined source and warn
+VLIB_TARGET("avx") inline float sum_lanes(__m256 v) {
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+VLIB_TARGET("avx2") inline int sum_lanes(__m256i v) {
+	__m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+	return _mm_cvtsi128_si32(s);
+}
+
+VLIB_TARGET("avx2,fma") float dot_avx2(const float *a, const float *b, int n) {
+	__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+	int i = 0;
+	for (;i + 16 <= n;i += 16) {
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+		s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+	}
+	if (i + 8 <= n) {
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+		i += 8;
+	}
+	float res = sum_lanes(_mm256_add_ps(s0, s1));
+	for (;i<n;++i) res += a[i] * b[i];
+	return res;
+}
+
+VLIB_TARGET("avx512f") float dot_avx512(const float *a, const float *b, int n) {
+	__m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+	int i = 0;
+	for (;i + 32 <= n;i += 32) {
+		s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), s0);
+		s1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), s1);
+	}
+	for (;i<n;i += 16) {
+		// masked load of the tail
+		__mmask16 mask = n - i >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+		s0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), s0);
+	}
+	s0 = _mm512_add_ps(s0, s1);
+	__m512d halves = _mm512_castps_pd(s0);
+	return sum_lanes(_mm256_add_ps(_mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, halves, 0)), _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, halves, 1))));
+}
+
+// cpuid leaf 1 ecx and leaf 7 ebx, xgetbv tells which registers the os saves
+void cpu_features(int &sse, int &avx2, int &avx512, int *f16c = NULL, int *avx512bw = NULL) {
+	int info[4], leaf7[4] = { 0 };
+	unsigned long long xcr0 = 0;
+#ifdef _MSC_VER
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+	__cpuid(info, 1);
+	if (max_leaf >= 7) __cpuidex(leaf7, 7, 0);
+	if (info[2] & (1 << 27)) xcr0 = _xgetbv(0);
+#else
+	unsigned int a, b, c, d;
+	__cpuid(0, a, b, c, d);
+	unsigned int max_leaf = a;
+	__cpuid(1, a, b, c, d);
+	info[0] = a; info[1] = b; info[2] = c; info[3] = d;
+	if (max_leaf >= 7) {
+		__cpuid_count(7, 0, a, b, c, d);
+		leaf7[1] = b;
+	}
+	if (info[2] & (1 << 27)) {
+		__asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+		xcr0 = ((unsigned long long)d << 32) | a;
+	}
+#endif
+	sse = (info[3] >> 25) & 1;
+	avx2 = (info[2] >> 12 & 1) && (info[2] >> 28 & 1) && (leaf7[1] >> 5 & 1) && (xcr0 & 6) == 6;
+	avx512 = (leaf7[1] >> 16 & 1) && (xcr0 & 0xE6) == 0xE6;
+	if (f16c) *f16c = avx2 && (info[2] >> 29 & 1);
+	if (avx512bw) *avx512bw = avx512 && (leaf7[1] >> 30 & 1);
+}
+#endif
+
+typedef float(*dot_kernel_t)(const float*, const float*, int);
+
+struct dot_kernel_info {
+	const char *name;
+	dot_kernel_t kernel;
+};
+
+// kernels the cpu supports, scalar first and the fastest last
+vector<dot_kernel_info> dot_kernels() {
+	vector<dot_kernel_info> kernels;
+	kernels.push_back({ "scalar", dot_scalar });
+#ifdef VLIB_X86
+	int sse, avx2, avx512;
+	cpu_features(sse, avx2, avx512);
+	if (sse) kernels.push_back({ "sse", dot_sse });
+	if (avx2) kernels.push_back({ "avx2", dot_avx2 });
+	if (avx512) kernels.push_back({ "avx512", dot_avx512 });
+#endif
+	return kernels;
+}
+
+// compares the kernel with the scalar one on pseudo-random vectors of all lengths up to 320,
+// returns the largest relative difference
+float dot_self_test(dot_kernel_t kernel) {
+	float a[320], b[320], worst = 0;
+	unsigned int seed = 12345;
+	for (int i = 0;i<320;++i) {
+		seed = seed * 1103515245 + 12345;
+		a[i] = (int)(seed >> 16 & 0x7FFF) / 16384.f - 1;
+		seed = seed * 1103515245 + 12345;
+		b[i] = (int)(seed >> 16 & 0x7FFF) / 16384.f - 1;
+	}
+	for (int n = 0;n <= 320;++n) {
+		float expected = dot_scalar(a, b, n), magnitude = 0;
+		for (int i = 0;i<n;++i) magnitude += fabs(a[i] * b[i]);
+		float diff = fabs(kernel(a, b, n) - expected) / max(magnitude, 1e-30f);
+		worst = max(worst, diff);
+	}
+	return worst;
+}
+
+#define VLIB_DOT_TOLERANCE 1e-5f
+
+// fastest kernel passing the self-test
+dot_kernel_t select_dot_kernel() {
+	vector<dot_kernel_info> kernels = dot_kernels();
+	for (int i = (int)kernels.size() - 1;i>0;--i) {
+		if (dot_self_test(kernels[i].kernel) <= VLIB_DOT_TOLERANCE) return kernels[i].kernel;
+	}
+	return dot_scalar;
+}
+
+dot_kernel_t dot_kernel = select_dot_kernel();
+
+// kernels of quantized rows: int8 rows are multiplied with an int8 query in integers, fp16 rows
+// with the fp32 query; both are selected as dot_kernel is
+inline float half_to_float(unsigned short h) {
+	unsigned int sign = (h & 0x8000u) << 16, exponent = h >> 10 & 0x1F, mantissa = h & 0x3FF, bits;
+	if (exponent == 0x1F) bits = sign | 0x7F800000u | mantissa << 13;
+	else if (exponent) bits = sign | (exponent + 112) << 23 | mantissa << 13;
+	else {
+		// subnormal halves are normal floats
+		float f = mantissa / 16777216.f;
+		return sign ? -f : f;
+	}
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+// rounds to the nearest half, ties to even
+inline unsigned short float_to_half(float f) {
+	unsigned int bits;
+	memcpy(&bits, &f, sizeof(bits));
+	unsigned short sign = bits >> 16 & 0x8000u;
+	float a = fabs(f);
+	if (a != a) return sign | 0x7E00;
+	if (a >= 65520.f) return sign | 0x7C00;
+	if (a<6.103515625e-05f) return sign | (unsigned short)lrintf(a * 16777216.f);
+	unsigned int h = ((bits >> 23 & 0xFF) - 112) << 10 | (bits & 0x7FFFFF) >> 13, rest = bits & 0x1FFF;
+	if (rest>0x1000 || (rest == 0x1000 && (h & 1))) ++h;
+	return sign | h;
+}
+
+int dot_i8_scalar(const signed char *a, const signed char *b, int n) {
+	int res = 0;
+	for (int i = 0;i<n;++i) {
+		res += a[i] * b[i];
 	}
 	return res;
 }
 
-inline float dot(const float *v1, const float *v2) {
+float dot_f16_scalar(const float *a, const unsigned short *b, int n) {
 	float res = 0;
-	for (int i = 0;i<vsize;++i) {
-		res += v1[i] * v2[i];
+	for (int i = 0;i<n;++i) {
+		res += a[i] * half_to_float(b[i]);
 	}
 	return res;
 }
 
-inline char* get_word(int id, char *s = NULL) {
-	if (s) strcpy(s, vocab + id*max_w);
-	else return vocab + id*max_w;
-	return s;
+#ifdef VLIB_X86
+VLIB_TARGET("sse2") int dot_i8_sse(const signed char *a, const signed char *b, int n) {
+	__m128i s = _mm_setzero_si128();
+	int i = 0;
+	for (;i + 16 <= n;i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(a + i)), y = _mm_loadu_si128((const __m128i*)(b + i));
+		// bytes unpacked with themselves and shifted back are sign extended to 16 bits
+		__m128i lo = _mm_madd_epi16(_mm_srai_epi16(_mm_unpacklo_epi8(x, x), 8), _mm_srai_epi16(_mm_unpacklo_epi8(y, y), 8));
+		__m128i hi = _mm_madd_epi16(_mm_srai_epi16(_mm_unpackhi_epi8(x, x), 8), _mm_srai_epi16(_mm_unpackhi_epi8(y, y), 8));
+		s = _mm_add_epi32(s, _mm_add_epi32(lo, hi));
+	}
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+	int res = _mm_cvtsi128_si32(s);
+	for (;i<n;++i) res += a[i] * b[i];
+	return res;
+}
+
+VLIB_TARGET("avx2") int dot_i8_avx2(const signed char *a, const signed char *b, int n) {
+	__m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256();
+	int i = 0;
+	for (;i + 32 <= n;i += 32) {
+		s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i))),
+			_mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)))));
+		s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(_mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i + 16))),
+			_mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i + 16)))));
+	}
+	if (i + 16 <= n) {
+		s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i))),
+			_mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)))));
+		i += 16;
+	}
+	int res = sum_lanes(_mm256_add_epi32(s0, s1));
+	for (;i<n;++i) res += a[i] * b[i];
+	return res;
+}
+
+VLIB_TARGET("avx512f,avx512bw") int dot_i8_avx512(const signed char *a, const signed char *b, int n) {
+	__m512i s = _mm512_setzero_si512();
+	int i = 0;
+	for (;i + 32 <= n;i += 32) {
+		s = _mm512_add_epi32(s, _mm512_madd_epi16(_mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(a + i))),
+			_mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(b + i)))));
+	}
+	int res = sum_lanes(_mm256_add_epi32(_mm512_maskz_extracti64x4_epi64(0xF, s, 0), _mm512_maskz_extracti64x4_epi64(0xF, s, 1)));
+	for (;i<n;++i) res += a[i] * b[i];
+	return res;
+}
+
+VLIB_TARGET("avx2,fma,f16c") float dot_f16_avx2(const float *a, const unsigned short *b, int n) {
+	__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+	int i = 0;
+	for (;i + 16 <= n;i += 16) {
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(b + i))), s0);
+		s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(b + i + 8))), s1);
+	}
+	if (i + 8 <= n) {
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(b + i))), s0);
+		i += 8;
+	}
+	float res = sum_lanes(_mm256_add_ps(s0, s1));
+	for (;i<n;++i) res += a[i] * half_to_float(b[i]);
+	return res;
+}
+#endif
+
+typedef int(*dot_i8_kernel_t)(const signed char*, const signed char*, int);
+typedef float(*dot_f16_kernel_t)(const float*, const unsigned short*, int);
+
+struct dot_quantized_kernel_info {
+	const char *name;
+	dot_i8_kernel_t i8;
+	dot_f16_kernel_t f16;		// the fastest fp16 kernel up to this instruction set
+};
+
+// quantized kernels the cpu supports, scalar first and the fastest last
+vector<dot_quantized_kernel_info> dot_quantized_kernels() {
+	vector<dot_quantized_kernel_info> kernels;
+	kernels.push_back({ "scalar", dot_i8_scalar, dot_f16_scalar });
+#ifdef VLIB_X86
+	int sse, avx2, avx512, f16c, avx512bw;
+	cpu_features(sse, avx2, avx512, &f16c, &avx512bw);
+	if (sse) kernels.push_back({ "sse", dot_i8_sse, dot_f16_scalar });
+	if (avx2) kernels.push_back({ "avx2", dot_i8_avx2, f16c ? dot_f16_avx2 : dot_f16_scalar });
+	if (avx512bw) kernels.push_back({ "avx512", dot_i8_avx512, f16c ? dot_f16_avx2 : dot_f16_scalar });
+#endif
+	return kernels;
+}
+
+// compares the kernels with the scalar ones as dot_self_test does; integer results must be equal,
+// returns the largest relative difference of the fp16 one
+float dot_quantized_self_test(const dot_quantized_kernel_info &kernel) {
+	signed char a[320], b[320];
+	unsigned short h[320];
+	float f[320], worst = 0;
+	unsigned int seed = 12345;
+	for (int i = 0;i<320;++i) {
+		seed = seed * 1103515245 + 12345;
+		a[i] = (signed char)((seed >> 16) % 255 - 127);
+		seed = seed * 1103515245 + 12345;
+		b[i] = (signed char)((seed >> 16) % 255 - 127);
+		f[i] = a[i] / 127.f;
+		h[i] = float_to_half(b[i] / 127.f);
+	}
+	for (int n = 0;n <= 320;++n) {
+		if (kernel.i8(a, b, n) != dot_i8_scalar(a, b, n)) return 1;
+		float expected = dot_f16_scalar(f, h, n), magnitude = 0;
+		for (int i = 0;i<n;++i) magnitude += fabs(f[i] * half_to_float(h[i]));
+		worst = max(worst, fabs(kernel.f16(f, h, n) - expected) / max(magnitude, 1e-30f));
+	}
+	return worst;
+}
+
+// fastest quantized kernels passing the self-test
+dot_quantized_kernel_info select_dot_quantized_kernel() {
+	vector<dot_quantized_kernel_info> kernels = dot_quantized_kernels();
+	for (int i = (int)kernels.size() - 1;i>0;--i) {
+		if (dot_quantized_self_test(kernels[i]) <= VLIB_DOT_TOLERANCE) return kernels[i];
+	}
+	return kernels[0];
+}
+
+dot_quantized_kernel_info dot_quantized_kernel = select_dot_quantized_kernel();
+
+inline float dot(int v1, int v2) {
+	return dot_kernel(M + (long long)v1*vstride, M + (long long)v2*vstride, vsize);
+}
+
+inline float dot(const int v1, float *v2) {
+	return dot_kernel(M + (long long)v1*vstride, v2, vsize);
+}
+
+inline float dot(const float *v1, const float *v2) {
+	return dot_kernel(v1, v2, vsize);
 }
 
 inline int get_word_index(const char *s, float* &vector = _dummy) {
-	int a = 0, b = words, mid, cmp;
-	while (a<b) {
-		mid = (a + b) / 2;
-		cmp = strcmp(s, vocab + mid*max_w);
-		if (!cmp) {
-			if (vector != _dummy) {
-				if (!vector) vector = (float*)malloc(vsize*sizeof(float));
-				for (int i = 0;i<vsize;++i)
-					vector[i] = M[i + mid*vsize];
-			}
-			return mid;
-		}
-		if (cmp>0) a = mid + 1;
-		else b = mid;
+	int id = find_word(s);
+	if (id >= 0 && vector != _dummy) {
+		if (!vector) vector = (float*)malloc(vsize*sizeof(float));
+		memcpy(vector, M + (long long)id*vstride, vsize*sizeof(float));
 	}
-	return -1;
+	return id;
 }
 
 inline int get_word_indexi(const char *s, float* &vector = _dummy) {
 	int a = 0, b = words, mid, cmp;
 	while (a<b) {
 		mid = (a + b) / 2;
-		cmp = _strcmpi(s, vocab + mid*max_w);
+		cmp = _strcmpi(s, get_word(mid));
 		if (!cmp) {
 			if (vector != _dummy) {
 				if (!vector) vector = (float*)malloc(vsize*sizeof(float));
 				for (int i = 0;i<vsize;++i)
-					vector[i] = M[i + mid*vsize];
+					vector[i] = M[i + (long long)mid*vstride];
 			}
 			return mid;
 		}
@@ -286,62 +1299,263 @@ inline int get_word_indexi(const char *s, float* &vector = _dummy) {
 inline const float* get_word_vector(int index, float* &vector = _dummy) {
 	if (!vector || vector == _dummy) vector = (float*)malloc(vsize*sizeof(float));
 	for (int i = 0;i<vsize;++i)
-		vector[i] = M[i + index*vsize];
+		vector[i] = M[i + (long long)index*vstride];
 	return vector;
 }
 
 inline int get_word_vector(const char *s, float* &vector = _dummy) {
-	int a = 0, b = words, mid, cmp;
-	while (a<b) {
-		mid = (a + b) / 2;
-		cmp = strcmp(s, vocab + mid*max_w);
-		if (!cmp) {
-			if (vector != _dummy) {
-				if (!vector) vector = (float*)malloc(vsize*sizeof(float));
-				for (int i = 0;i<vsize;++i)
-					vector[i] = M[i + mid*vsize];
-			}
-			return 1;
-		}
-		if (cmp>0) a = mid + 1;
-		else b = mid;
-	}
-	return 0;
+	return get_word_index(s, vector) >= 0;
 }
 
 int get_word_vectori(const char *s, float* &vector = _dummy) {
-	int a = 0, b = words, mid, cmp;
-	while (a<b) {
-		mid = (a + b) / 2;
-		cmp = _strcmpi(s, vocab + mid*max_w);
-		if (!cmp) {
-			if (vector != _dummy) {
-				if (!vector) vector = (float*)malloc(vsize*sizeof(float));
-				for (int i = 0;i<vsize;++i)
-					vector[i] = M[i + mid*vsize];
+	return get_word_indexi(s, vector) >= 0;
+}
+
+// writes the loaded vectors in the indexed format mapped by map_vectors(): header, aligned rows,
+// offsets of words, pool of words and their hash index
+void write_vectors_indexed(const char *filename) {
+	vlib_indexed_header header;
+	int stride = (vsize + VLIB_ROW_ALIGNMENT / sizeof(float) - 1) / (VLIB_ROW_ALIGNMENT / sizeof(float))*(VLIB_ROW_ALIGNMENT / sizeof(float));
+	long long *offsets = (long long*)malloc(words*sizeof(long long)), pool_size = 0;
+	float *row = (float*)calloc(stride, sizeof(float));
+	int *index;
+	long long slots;
+	static const char padding[VLIB_ROW_ALIGNMENT] = { 0 };
+	if (!offsets || !row) err("Failed to allocate memory for indexed vectors\n");
+	for (int i = 0;i<words;++i) {
+		offsets[i] = pool_size;
+		pool_size += strlen(get_word(i)) + 1;
+	}
+	build_word_index(index, slots);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VLIB_INDEXED_MAGIC, 8);
+	header.words = words;
+	header.vsize = vsize;
+	header.max_w = max_w;
+	header.stride = stride;
+	header.matrix_offset = (sizeof(header) + VLIB_ROW_ALIGNMENT - 1) / VLIB_ROW_ALIGNMENT*VLIB_ROW_ALIGNMENT;
+	header.offsets_offset = header.matrix_offset + words*(long long)stride*sizeof(float);
+	header.pool_offset = header.offsets_offset + words*sizeof(long long);
+	header.pool_size = pool_size;
+	header.index_offset = (header.pool_offset + pool_size + sizeof(int) - 1) / sizeof(int)*sizeof(int);
+	header.index_slots = slots;
+
+	FILE *f = fopen(filename, "wb");
+	if (!f) err("Cannot create file: %s\n", filename);
+	fprintf(stderr, "Writing file %s...", filename);
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(padding, 1, header.matrix_offset - sizeof(header), f);
+	for (int i = 0;i<words;++i) {
+		memcpy(row, M + (long long)i*vstride, vsize*sizeof(float));
+		fwrite(row, sizeof(float), stride, f);
+	}
+	fwrite(offsets, sizeof(long long), words, f);
+	for (int i = 0;i<words;++i) fwrite(get_word(i), 1, strlen(get_word(i)) + 1, f);
+	fwrite(padding, 1, header.index_offset - header.pool_offset - pool_size, f);
+	fwrite(index, sizeof(int), slots, f);
+	if (ferror(f) | fclose(f)) err("Write error: %s\n", filename);
+	fprintf(stderr, "ok\n");
+	free(index);
+	free(row);
+	free(offsets);
+}
+
+// quantized copy of M: rows of int8 with a scale per row or of fp16, VLIB_ROW_ALIGNMENT aligned; the
+// scan compares the query with them and checks the best quantized_rerank * k candidates in fp32
+#define VLIB_QUANTIZED_MAGIC "VLIBQNT1"
+#define VLIB_QUANTIZED_INT8 1
+#define VLIB_QUANTIZED_FP16 2
+#define VLIB_QUANTIZED_RERANK_DEFAULT 4
+
+struct vlib_quantized_header {
+	char magic[8];
+	int words, vsize, type, stride;		// stride: bytes between rows
+	long long rows_offset,				// words*stride bytes
+		scales_offset;					// words floats of int8 rows
+	unsigned long long fingerprint;		// of the vectors the rows come from
+};
+
+int quantized_type = 0, quantized_stride = 0;
+const char *quantized_rows = NULL;
+const float *quantized_scales = NULL;
+int quantized_rerank = VLIB_QUANTIZED_RERANK_DEFAULT;	// 0 keeps the quantized distances
+
+// int8 values of v with the scale of the largest one
+float quantize_row(const float *v, signed char *q) {
+	float largest = 0;
+	for (int i = 0;i<vsize;++i) largest = max(largest, (float)fabs(v[i]));
+	float scale = largest>0 ? largest / 127 : 1;
+	for (int i = 0;i<vsize;++i) q[i] = (signed char)max(-127L, min(127L, lrintf(v[i] / scale)));
+	return scale;
+}
+
+// writes the quantized rows of M for map_vectors_quantized()
+void write_vectors_quantized(const char *filename, int type) {
+	vlib_quantized_header header;
+	int value = type == VLIB_QUANTIZED_INT8 ? 1 : 2;
+	vector<char> row((vsize*value + VLIB_ROW_ALIGNMENT - 1) / VLIB_ROW_ALIGNMENT*VLIB_ROW_ALIGNMENT);
+	vector<float> scales(words, 1);
+	static const char padding[VLIB_ROW_ALIGNMENT] = { 0 };
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VLIB_QUANTIZED_MAGIC, 8);
+	header.words = words;
+	header.vsize = vsize;
+	header.type = type;
+	header.stride = row.size();
+	header.rows_offset = (sizeof(header) + VLIB_ROW_ALIGNMENT - 1) / VLIB_ROW_ALIGNMENT*VLIB_ROW_ALIGNMENT;
+	header.scales_offset = header.rows_offset + words*(long long)row.size();
+	header.fingerprint = cache_fingerprint();
+
+	FILE *f = fopen(filename, "wb");
+	if (!f) err("Cannot create file: %s\n", filename);
+	fprintf(stderr, "Writing file %s...", filename);
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(padding, 1, header.rows_offset - sizeof(header), f);
+	for (int i = 0;i<words;++i) {
+		const float *v = M + (long long)i*vstride;
+		if (type == VLIB_QUANTIZED_INT8) scales[i] = quantize_row(v, (signed char*)row.data());
+		else for (int j = 0;j<vsize;++j) ((unsigned short*)row.data())[j] = float_to_half(v[j]);
+		fwrite(row.data(), 1, row.size(), f);
+	}
+	fwrite(scales.data(), sizeof(float), words, f);
+	if (ferror(f) | fclose(f)) err("Write error: %s\n", filename);
+	fprintf(stderr, "ok\n");
+}
+
+// maps the quantized rows of the loaded vectors
+void map_vectors_quantized(const char *filename) {
+	size_t file_size;
+	fprintf(stderr, "Mapping file %s...", filename);
+	char *base = map_file(filename, file_size);
+	const vlib_quantized_header *header = (const vlib_quantized_header*)base;
+	if (file_size<sizeof(*header) || memcmp(header->magic, VLIB_QUANTIZED_MAGIC, 8)) err("Not quantized vectors: %s\n", filename);
+	if (header->words != words || header->vsize != vsize || header->fingerprint != cache_fingerprint()) err("Quantized vectors %s do not match the vectors\n", filename);
+	if (file_size<header->scales_offset + words*sizeof(float)) err("Read error: %s is too short\n", filename);
+	quantized_type = header->type;
+	quantized_stride = header->stride;
+	quantized_rows = base + header->rows_offset;
+	quantized_scales = (const float*)(base + header->scales_offset);
+	fprintf(stderr, "%s\n", quantized_type == VLIB_QUANTIZED_INT8 ? "int8" : "fp16");
+}
+
+// k smallest (distance, id) pairs, ordered as tuple<float, int> is, kept as a max-heap in fixed arrays;
+// a candidate farther than the worst kept one is rejected by one comparison before any heap work and
+// a better one replaces the root with a single sift down
+struct top_k {
+	vector<float> dist;
+	vector<int> id;
+	int k = 0, n = 0;
+	float worst = FLT_MAX;		// distance of the root once k pairs are kept
+
+	// empties the selector, the arrays only grow
+	void reset(int _k) {
+		k = _k;
+		n = 0;
+		worst = k>0 ? FLT_MAX : -FLT_MAX;
+		if ((int)dist.size()<max(k, 1)) {
+			dist.resize(max(k, 1));
+			id.resize(max(k, 1));
+		}
+	}
+
+	static inline bool after(float da, int ia, float db, int ib) {
+		return da>db || (da == db && ia>ib);
+	}
+
+	// moves the hole at the root down to where pair d, i belongs among the first size pairs
+	inline void sift_down(float d, int i, int size) {
+		int c = 0;
+		for (int l = 1;l<size;l = 2 * c + 1) {
+			// the later child without a branch on which one it is
+			int m = l + (l + 1<size && after(dist[l + 1], id[l + 1], dist[l], id[l]));
+			if (!after(dist[m], id[m], d, i)) break;
+			dist[c] = dist[m];
+			id[c] = id[m];
+			c = m;
+		}
+		dist[c] = d;
+		id[c] = i;
+	}
+
+	inline void push(float d, int i) {
+		if (d>worst) return;
+		if (n<k) {
+			int c = n++;
+			for (int p = (c - 1) / 2;c>0 && after(d, i, dist[p], id[p]);c = p, p = (c - 1) / 2) {
+				dist[c] = dist[p];
+				id[c] = id[p];
 			}
-			return 1;
+			dist[c] = d;
+			id[c] = i;
+			if (n == k) worst = dist[0];
+			return;
 		}
-		if (cmp>0) a = mid + 1;
-		else b = mid;
+		if (!after(dist[0], id[0], d, i)) return;
+		sift_down(d, i, k);
+		worst = dist[0];
 	}
-	return 0;
-}
 
-namespace _vp_tree {
-	int *indices;
-	atomic<int> processed;
+	void merge(const top_k &other) {
+		for (int j = 0;j<other.n;++j) push(other.dist[j], other.id[j]);
+	}
 
-	struct _vp_tree_node {
-		int id;
-		float radius;
-		_vp_tree_node *child[2];
-		_vp_tree_node(int _id) : id(_id) { child[0] = child[1] = NULL; }
-		~_vp_tree_node() {
-			delete child[0];
-			delete child[1];
+	// writes the pairs in ascending order and -1 for the missing ones up to k, the selector is emptied;
+	// returns the number of pairs
+	int extract(int *results, float *distances) {
+		int found = n;
+		for (int last = n - 1;last>0;--last) {
+			float d = dist[last];
+			int i = id[last];
+			dist[last] = dist[0];
+			id[last] = id[0];
+			sift_down(d, i, last);
 		}
-	} *root = NULL;
+		for (int j = 0;j<found;++j) {
+			results[j] = id[j];
+			distances[j] = dist[j];
+		}
+		if (found<k) memset(results + found, -1, sizeof(int)*(k - found));
+		reset(k);
+		return found;
+	}
+};
+
+// vantage-point tree stored as a flat array of nodes in preorder: the node at position p covers
+// positions p..end-1, its inner subtree starts at p + 1 and its outer one at split; it uses the chord
+// distance sqrt(2 (1 - dot)) of unit vectors, a metric ordering the words as 1 - dot does
+#define VLIB_VP_TREE_MAGIC "VLIBVPT1"
+#define VLIB_VP_TREE_TASK 4096			// smaller subtrees are built by the thread which split them
+#define VLIB_VP_TREE_SLACK 1e-5f		// rounding of distances must not prune exact neighbours
+#define VLIB_VP_TREE_NORM_TOLERANCE 1e-3f	// of the squared length of the rows
+
+struct vlib_vp_tree_header {
+	char magic[8];
+	int words, vsize;
+	unsigned long long fingerprint;		// of the vectors the tree was built from
+};
+
+struct vp_tree_node {
+	int id;
+	float radius;		// inner subtree is not farther, outer one is not closer
+	int split, end;
+};
+
+#define VLIB_KNN_SCAN 0
+#define VLIB_KNN_VP_TREE 1
+
+// search used by k_nearest3, the tree is built or mapped before selecting it
+int knn_backend = VLIB_KNN_SCAN;
+
+namespace _vp_tree {
+	const vp_tree_node *nodes = NULL;
+	vector<vp_tree_node> built;
+	atomic<int> processed;
+	mutex task_lock;
+	condition_variable task_ready;		// workers wait for tasks
+	condition_variable build_done;		// build_vp_tree() waits for the last task
+	vector<pair<int, int>> tasks;
+	int pending = 0;
 
 	inline float distance(const int a, const int b) {
 		return 1 - dot(a, b);
@@ -351,316 +1565,970 @@ namespace _vp_tree {
 		return 1 - dot(a, b);
 	}
 
-	struct cmp {
-		const int item;
-		cmp(const int item) :item(item) {}
-		int operator()(const int a, const int b) {
-			return distance(item, a)<distance(item, b);
-		}
-	};
-
-	void build(_vp_tree_node** node, int a, int b) {
-		if (a == b) {
-			*node = NULL;
-			return;
-		}
-		*node = new _vp_tree_node(indices[a]);
-		++processed;
-		if (b - a>1) {
-			int x = (int)((float)rand() / RAND_MAX*(b - a - 1)) + a;
-			if (x != a) swap(_vp_tree::indices[a], _vp_tree::indices[x]);
-			int median = (a + 1 + b) / 2;
-			nth_element(indices + a + 1, indices + median, indices + b, cmp(indices[a]));
-			(*node)->radius = distance(indices[a], indices[median]);
-			for (int i = a + 1;i<b;++i) {
-				if (indices[a] == indices[i]) err("zle");
-			}
-			if (no_threads<thread::hardware_concurrency()) {
-				++no_threads;
-				// thread does not support passing by reference ?
-				thread t1(build, (*node)->child, a + 1, median);
-				thread t2(build, (*node)->child + 1, median, b);
-				t1.join();
-				t2.join();
-				--no_threads;
-			}
-			else {
-				build((*node)->child, a + 1, median);
-				build((*node)->child + 1, median, b);
-			}
-		}
+	inline float chord(float distance) {
+		return sqrtf(max(0.f, 2 * distance));
 	}
 
-	typedef tuple<float, int> T;
-
-	void search(_vp_tree_node *node, int target, unsigned int k, priority_queue<T, deque<T>> &heap, float &tau) {
-		if (node == NULL) return;
-		float dist = distance(node->id, target);
-		if (dist<tau) {
-			if (heap.size() == k) heap.pop();
-			pp("add %d:%s\n", node->id, get_word(node->id));
-			heap.push(make_tuple(dist, node->id));
-			if (heap.size() == k) tau = get<0>(heap.top());
-		}
-		if (node->child[0] == NULL&&node->child[1] == NULL)
-			return;
-		if (dist<node->radius) {
-			if (dist - tau <= node->radius)
-				search(node->child[0], target, k, heap, tau);
-			if (dist + tau >= node->radius)
-				search(node->child[1], target, k, heap, tau);
-		}
-		else {
-			if (dist + tau >= node->radius)
-				search(node->child[1], target, k, heap, tau);
-			if (dist - tau <= node->radius)
-				search(node->child[0], target, k, heap, tau);
+	void push_task(int a, int b) {
+		{
+			lock_guard<mutex> guard(task_lock);
+			tasks.push_back(make_pair(a, b));
+			++pending;
 		}
+		task_ready.notify_one();
 	}
 
-	void k_nearest(int a, int b, int target, unsigned int k, priority_queue<T, deque<T>> *heap) {
-		for (int i = a;i<b;++i) {
-			heap->push(make_tuple(distance(i, target), i));
-			if (heap->size()>k) heap->pop();
+	// builds positions a..b-1 of built, whose ids are the words of the subtree
+	void build(int a, int b, vector<pair<float, int>> &scratch) {
+		while (a<b) {
+			vp_tree_node &node = built[a];
+			// vantage point is chosen from the range only, so the tree does not depend on threads
+			unsigned long long h = ((unsigned long long)a * 2654435761ULL) ^ ((unsigned long long)b * 40503ULL);
+			swap(node.id, built[a + (int)(h % (b - a))].id);
+			node.end = b;
+			++processed;
+			if (b - a == 1) {
+				node.radius = 0;
+				node.split = b;
+				return;
+			}
+			scratch.clear();
+			for (int i = a + 1;i<b;++i) scratch.push_back(make_pair(chord(distance(built[i].id, node.id)), built[i].id));
+			int median = (a + 1 + b) / 2;
+			nth_element(scratch.begin(), scratch.begin() + (median - a - 1), scratch.end());
+			node.radius = scratch[median - a - 1].first;
+			node.split = median;
+			for (int i = a + 1;i<b;++i) built[i].id = scratch[i - a - 1].second;
+			if (b - median >= VLIB_VP_TREE_TASK) push_task(median, b);
+			else build(median, b, scratch);
+			a = a + 1;
+			b = median;
 		}
 	}
 
-	void k_nearest_v(int a, int b, float* target, unsigned int k, priority_queue<T, deque<T>> *heap) {
-		for (int i = a;i<b;++i) {
-			heap->push(make_tuple(distance(i, target), i));
-			if (heap->size()>k) heap->pop();
+	void build_worker() {
+		vector<pair<float, int>> scratch;
+		for (;;) {
+			pair<int, int> task;
+			{
+				unique_lock<mutex> guard(task_lock);
+				task_ready.wait(guard, [] { return !tasks.empty() || pending == 0; });
+				if (tasks.empty()) return;
+				task = tasks.back();
+				tasks.pop_back();
+			}
+			build(task.first, task.second, scratch);
+			lock_guard<mutex> guard(task_lock);
+			if (--pending == 0) {
+				task_ready.notify_all();
+				build_done.notify_all();
+			}
 		}
 	}
 
-	void k_nearest_v_idf(int a, int b, float* target, unsigned int k, priority_queue<T, deque<T>> *heap) {
-		for (int i = a;i<b;++i) {
-			heap->push(make_tuple(idf(i)*distance(i, target), i));
-			if (heap->size()>k) heap->pop();
+	// keeps the k smallest (distance_of(id), id) of subtree p in heap, tau is the chord distance of
+	// the farthest of them
+	template<class F> void search(int p, top_k &heap, float &tau, F distance_of) {
+		const vp_tree_node &node = nodes[p];
+		float d = distance_of(node.id), dist = chord(d);
+		heap.push(d, node.id);
+		if (heap.n == heap.k) tau = chord(heap.worst) + VLIB_VP_TREE_SLACK;
+		bool inner = p + 1<node.split, outer = node.split<node.end;
+		if (dist<node.radius) {
+			if (inner && dist - tau <= node.radius) search(p + 1, heap, tau, distance_of);
+			if (outer && dist + tau >= node.radius) search(node.split, heap, tau, distance_of);
 		}
-	}
-
-	void k_nearest_v_imf(int a, int b, float* target, unsigned int k, priority_queue<T, deque<T>> *heap) {
-		for (int i = a;i<b;++i) {
-			heap->push(make_tuple(imf(i)*distance(i, target), i));
-			if (heap->size()>k) heap->pop();
+		else {
+			if (outer && dist + tau >= node.radius) search(node.split, heap, tau, distance_of);
+			if (inner && dist - tau <= node.radius) search(p + 1, heap, tau, distance_of);
 		}
 	}
 }
 
+// builds the tree in memory, subtrees of VLIB_VP_TREE_TASK and more words are tasks of all cores
 void build_vp_tree() {
-	if (_vp_tree::root) return;
-	thread t([] {
-		while (_vp_tree::processed<words) {
-			this_thread::sleep_for(milliseconds(100));
-			fprintf(stderr, "Building vantage-point tree...%2.2f%%\r", _vp_tree::processed / (float)words * 100);
-		}
-	});
+	using namespace _vp_tree;
+	if (nodes) return;
+	// the chord distance is a metric only for unit vectors, other rows would make the search inexact
+	for (int i = 0;i<words;++i) {
+		float norm = dot(i, i);
+		if (fabs(norm - 1)>VLIB_VP_TREE_NORM_TOLERANCE) err("Vantage-point tree needs unit vectors, word %s has length %f\n", get_word(i), sqrt(norm));
+	}
 	fprintf(stderr, "Building vantage-point tree...\r");
 	time_point1 = high_resolution_clock::now();
-	_vp_tree::indices = new int[words];
-	_vp_tree::processed = 0;
-	for (int i = 0;i<words;++i) _vp_tree::indices[i] = i;
-	build(&_vp_tree::root, 0, words);
-	delete[] _vp_tree::indices;
+	built.resize(words);
+	for (int i = 0;i<words;++i) built[i].id = i;
+	processed = 0;
+	vector<thread> workers;
+	if (words) push_task(0, words);
+	for (int i = max(1, (int)thread::hardware_concurrency());i>0;--i) workers.push_back(thread(build_worker));
+	{
+		unique_lock<mutex> guard(task_lock);
+		while (!build_done.wait_for(guard, milliseconds(500), [] { return pending == 0; }))
+			fprintf(stderr, "Building vantage-point tree...%2.2f%%\r", processed / (float)words * 100);
+	}
+	for (size_t i = 0;i<workers.size();++i) workers[i].join();
+	nodes = built.data();
 	duration<double> time_span = duration_cast<duration<double>>(high_resolution_clock::now() - time_point1);
-	t.join();
 	fprintf(stderr, "Building vantage-point tree...ok (%lf seconds)\n", time_span.count());
 }
 
-void k_nearest(int target, int k, int* &results, float* &distances) {
-	if (!_vp_tree::root) build_vp_tree();
-	priority_queue<_vp_tree::T, deque<_vp_tree::T>> heap;
+// builds the tree if needed and writes it for map_vp_tree()
+void write_vp_tree(const char *filename) {
+	vlib_vp_tree_header header;
+	build_vp_tree();
+	FILE *f = fopen(filename, "wb");
+	if (!f) err("Cannot create file: %s\n", filename);
+	fprintf(stderr, "Writing file %s...", filename);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VLIB_VP_TREE_MAGIC, 8);
+	header.words = words;
+	header.vsize = vsize;
+	header.fingerprint = cache_fingerprint();
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(_vp_tree::nodes, sizeof(vp_tree_node), words, f);
+	if (ferror(f) | fclose(f)) err("Write error: %s\n", filename);
+	fprintf(stderr, "ok\n");
+}
+
+// maps the tree of the loaded vectors
+void map_vp_tree(const char *filename) {
+	size_t file_size;
+	char *base = map_file(filename, file_size);
+	const vlib_vp_tree_header *header = (const vlib_vp_tree_header*)base;
+	if (file_size<sizeof(*header) || memcmp(header->magic, VLIB_VP_TREE_MAGIC, 8)) err("Not a vantage-point tree: %s\n", filename);
+	if (header->words != words || header->vsize != vsize || header->fingerprint != cache_fingerprint()) err("Vantage-point tree %s does not match the vectors\n", filename);
+	if (file_size<sizeof(*header) + (size_t)words*sizeof(vp_tree_node)) err("Read error: %s is too short\n", filename);
+	_vp_tree::nodes = (const vp_tree_node*)(base + sizeof(*header));
+}
+
+// k nearest words of target in the tree, safe in many threads; returns the number found
+int vp_tree_nearest(const float *target, int k, int *results, float *distances) {
+	static thread_local top_k heap;
 	float tau = FLT_MAX;
+	heap.reset(k);
+	if (words && k>0) _vp_tree::search(0, heap, tau, [&](int i) { return 1 - dot_kernel(M + (long long)i*vstride, target, vsize); });
+	return heap.extract(results, distances);
+}
+
+void k_nearest(int target, int k, int* &results, float* &distances) {
+	build_vp_tree();
 	if (!results) results = new int[k];
 	if (!distances) distances = new float[k];
-	_vp_tree::search(_vp_tree::root, target, k, heap, tau);
-	int n = heap.size();
-	if (n<k) memset(results + n, -1, sizeof(int)*(k - n));
-	for (int i = n - 1;i >= 0;--i) {
-		tie(distances[i], results[i]) = heap.top();
-		heap.pop();
-	}
+	vp_tree_nearest(M + (long long)target*vstride, k, results, distances);
 }
 
 void k_nearest2(int target, unsigned int k, int* &results, float* &distances) {
-	priority_queue<_vp_tree::T, deque<_vp_tree::T>> heap;
+	static thread_local top_k heap;
 	if (!results) results = new int[k];
 	if (!distances) distances = new float[k];
-	for (int i = 0;i<words;++i) {
-		heap.push(make_tuple(_vp_tree::distance(i, target), i));
-		if (heap.size()>k) heap.pop();
-	}
-	unsigned int n = heap.size();
-	if (n<k) memset(results + n, -1, sizeof(int)*(k - n));
-	for (int i = n - 1;i >= 0;--i) {
-		tie(distances[i], results[i]) = heap.top();
-		heap.pop();
-	}
+	heap.reset(k);
+	for (int i = 0;i<words;++i) heap.push(_vp_tree::distance(i, target), i);
+	heap.extract(results, distances);
 }
 
 int k_nearest2(float* target, unsigned int k, int* &results, float* &distances, int id = -1) {
-	if (id != -1 && cache_results&&cache_distances&&cache_results[id]) {
-		memcpy(results, cache_results[id], sizeof(int)*k);
-		memcpy(distances, cache_distances[id], sizeof(float)*k);
-		return k;
-	}
-	priority_queue<_vp_tree::T, deque<_vp_tree::T>> heap;
+	return cache_get(id, k, results, distances, [&]() -> int {
+	static thread_local top_k heap;
 	if (!results) results = new int[k];
 	if (!distances) distances = new float[k];
-	for (int i = 0;i<words;++i) {
-		heap.push(make_tuple(_vp_tree::distance(i, target), i));
-		if (heap.size()>k) heap.pop();
-	}
-	unsigned int n = heap.size();
-	if (n<k) memset(results + n, -1, sizeof(int)*(k - n));
-	for (int i = n - 1;i >= 0;--i) {
-		tie(distances[i], results[i]) = heap.top();
-		heap.pop();
-	}
-	if (id != -1 && cache_results&&cache_distances) {
-		cache_results[id] = new int[k];
-		cache_distances[id] = new float[k];
-		memcpy(cache_results[id], results, sizeof(int)*k);
-		memcpy(cache_distances[id], distances, sizeof(float)*k);
-	}
-	return n;
+	heap.reset(k);
+	for (int i = 0;i<words;++i) heap.push(_vp_tree::distance(i, target), i);
+	return heap.extract(results, distances);
+	});
 }
 
 int k_nearest2f(float* target, unsigned int k, int* &results, float* &distances, float *metric, int id = -1) {
-	if (id != -1 && cache_results&&cache_distances&&cache_results[id]) {
-		memcpy(results, cache_results[id], sizeof(int)*k);
-		memcpy(distances, cache_distances[id], sizeof(float)*k);
-		return k;
-	}
-	priority_queue<_vp_tree::T, deque<_vp_tree::T>> heap;
+	return cache_get(id, k, results, distances, [&]() -> int {
+	static thread_local top_k heap;
 	if (!results) results = new int[k];
 	if (!distances) distances = new float[k];
-	for (int i = 0;i<words;++i) {
-		heap.push(make_tuple(_vp_tree::distance(i, target)*(1 - metric[i]), i));
-		if (heap.size()>k) heap.pop();
-	}
-	unsigned int n = heap.size();
-	if (n<k) memset(results + n, -1, sizeof(int)*(k - n));
-	for (int i = n - 1;i >= 0;--i) {
-		tie(distances[i], results[i]) = heap.top();
-		heap.pop();
+	heap.reset(k);
+	for (int i = 0;i<words;++i) heap.push(_vp_tree::distance(i, target)*(1 - metric[i]), i);
+	return heap.extract(results, distances);
+	});
+}
+
+// workers scanning slices of the vocabulary for k_nearest3*, started once and kept for all queries
+namespace _knn_pool {
+	vector<thread> workers;
+	vector<top_k> heaps;			// selector of every worker
+	vector<vector<top_k>> batch_heaps;	// selectors of every worker and target of a batch
+	top_k merged;
+	mutex pool_lock, query_lock;
+	condition_variable wake, done;
+	function<void(int)> job;
+	unsigned long long generation = 0;
+	int remaining = 0;
+	bool stop = false;
+
+	void work(int id) {
+		unsigned long long seen = 0;
+		for (;;) {
+			{
+				unique_lock<mutex> guard(pool_lock);
+				wake.wait(guard, [&] { return stop || generation != seen; });
+				if (stop) return;
+				seen = generation;
+			}
+			job(id);
+			lock_guard<mutex> guard(pool_lock);
+			if (--remaining == 0) done.notify_one();
+		}
 	}
-	if (id != -1 && cache_results&&cache_distances) {
-		cache_results[id] = new int[k];
-		cache_distances[id] = new float[k];
-		memcpy(cache_results[id], results, sizeof(int)*k);
-		memcpy(cache_distances[id], distances, sizeof(float)*k);
+}
+
+void knn_pool_stop() {
+	using namespace _knn_pool;
+	{
+		lock_guard<mutex> guard(pool_lock);
+		stop = true;
+	}
+	wake.notify_all();
+	for (size_t i = 0;i<workers.size();++i) workers[i].join();
+	workers.clear();
+	stop = false;
+}
+
+// starts n workers (all cores for 0), threads left running at exit would abort the process
+void knn_pool_start(int n = 0) {
+	using namespace _knn_pool;
+	static bool registered = false;
+	if (!workers.empty()) return;
+	if (n <= 0) n = max(1, (int)thread::hardware_concurrency());
+	heaps.resize(n);
+	for (int i = 0;i<n;++i) workers.push_back(thread(work, i));
+	if (!registered) {
+		atexit(knn_pool_stop);
+		registered = true;
 	}
-	return n;
 }
 
-int k_nearest3(float* target, int k, int* &results, float* &distances, int id = -1) {
-	//if (!results) results=new int[k];
-	//if (!distances) distances=new float[k];
-	if (id != -1 && cache_results&&cache_distances&&cache_results[id]) {
-		memcpy(results, cache_results[id], sizeof(int)*k);
-		memcpy(distances, cache_distances[id], sizeof(float)*k);
-		return k;
+// runs job(i) on every worker i and waits for all of them, callers hold _knn_pool::query_lock
+void knn_pool_run(const function<void(int)> &job) {
+	using namespace _knn_pool;
+	{
+		lock_guard<mutex> guard(pool_lock);
+		_knn_pool::job = job;
+		remaining = workers.size();
+		++generation;
+	}
+	wake.notify_all();
+	unique_lock<mutex> guard(pool_lock);
+	done.wait(guard, [] { return remaining == 0; });
+}
+
+// k smallest distance_of(i) over the vocabulary, every worker selects from its slice
+template<class F> int k_nearest_pooled(int k, int* results, float* distances, F distance_of) {
+	using namespace _knn_pool;
+	lock_guard<mutex> guard(query_lock);
+	knn_pool_start();
+	int tc = workers.size();
+	knn_pool_run([&](int t) {
+		int a = words / tc*t, b = t + 1 == tc ? words : words / tc*(t + 1);
+		top_k &heap = heaps[t];
+		heap.reset(k);
+		for (int i = a;i<b;++i) heap.push(distance_of(i), i);
+	});
+	merged.reset(k);
+	for (int t = 0;t<tc;++t) merged.merge(heaps[t]);
+	return merged.extract(results, distances);
+}
+
+// hierarchical navigable small world graph over the rows of M for approximate nearest words: every
+// word has up to hnsw m links on each of its upper levels and 2 m on level 0; a search descends
+// greedily from the entry point and keeps the hnsw_ef closest candidates on level 0
+#define VLIB_HNSW_MAGIC "VLIBHNS1"
+#define VLIB_HNSW_M 16
+#define VLIB_HNSW_EF_CONSTRUCTION 200
+#define VLIB_HNSW_EF_DEFAULT 64
+#define VLIB_HNSW_MAX_LEVEL 16
+
+struct vlib_hnsw_header {
+	char magic[8];
+	int words, vsize, m, entry, max_level, reserved;
+	long long upper_size;				// ints of the upper levels
+	unsigned long long fingerprint;		// of the vectors the graph was built from
+};
+
+#define VLIB_KNN_HNSW 2
+
+int hnsw_ef = VLIB_HNSW_EF_DEFAULT;
+
+namespace _hnsw {
+	typedef pair<float, int> P;
+	int m = VLIB_HNSW_M, entry = -1, max_level = -1;
+	const int *levels = NULL;				// top level of every word
+	const int *links0 = NULL;				// rows of 1 + 2 m ints, count and links on level 0
+	const long long *upper_offset = NULL;	// first int of the upper levels of every word in upper
+	const int *upper = NULL;				// rows of 1 + m ints for levels 1..levels[id]
+	vector<int> levels_data, links0_data, upper_data;
+	vector<long long> upper_offset_data;
+	vector<mutex> *node_locks = NULL;		// only while the graph is built
+	mutex entry_lock;
+	atomic<int> processed;
+
+	inline int *links(int id, int level) {
+		return const_cast<int*>(level ? upper + upper_offset[id] + (long long)(level - 1)*(m + 1) : links0 + (long long)id*(2 * m + 1));
 	}
-	int tc = thread::hardware_concurrency() - no_threads;
-	if (!tc) {
-		fprintf(stderr, "Thread deficit!!!\n");
-		tc = 1;
+
+	inline int capacity(int level) {
+		return level ? m : 2 * m;
 	}
-	using namespace _vp_tree;
-	vector<priority_queue<T, deque<T>>> heap(tc);
-	vector<thread> t(tc);
-	for (int i = 0, a = 0, b;i<tc;++i, a = b) {
-		if (i + 1 == tc) b = words;
-		else b = words / tc*(i + 1);
-		t[i] = thread(k_nearest_v, a, b, target, k, &heap[i]);
+
+	inline float distance(int id, const float *target) {
+		return 1 - dot_kernel(M + (long long)id*vstride, target, vsize);
+	}
+
+	// copies the links of id on level, under the lock of id while the graph is built
+	inline int read_links(int id, int level, int *copy) {
+		unique_lock<mutex> guard;
+		if (node_locks) guard = unique_lock<mutex>((*node_locks)[id]);
+		const int *row = links(id, level);
+		memcpy(copy, row + 1, row[0] * sizeof(int));
+		return row[0];
+	}
+
+	// closest word on level reachable greedily from cur
+	int greedy(const float *target, int cur, float &dist, int level) {
+		vector<int> copy(2 * m);
+		for (bool changed = true;changed;) {
+			changed = false;
+			int n = read_links(cur, level, copy.data());
+			for (int i = 0;i<n;++i) {
+				float d = distance(copy[i], target);
+				if (d<dist) {
+					dist = d;
+					cur = copy[i];
+					changed = true;
+				}
+			}
+		}
+		return cur;
 	}
-	for (int i = 0;i<tc;++i) {
-		t[i].join();
+
+	// ef closest words on level found from the entry, as a max-heap
+	void search_layer(const float *target, int entry, float dist, int ef, int level, vector<P> &found) {
+		static thread_local vector<unsigned int> visited;
+		static thread_local unsigned int visit = 0;
+		vector<P> candidates;
+		vector<int> copy(2 * m);
+		if (visited.size() != (size_t)words) {
+			visited.assign(words, 0);
+			visit = 0;
+		}
+		if (++visit == 0) {
+			fill(visited.begin(), visited.end(), 0);
+			visit = 1;
+		}
+		visited[entry] = visit;
+		found.assign(1, P(dist, entry));
+		candidates.push_back(P(-dist, entry));
+		while (!candidates.empty()) {
+			P c = candidates.front();
+			if (-c.first>found.front().first && (int)found.size() >= ef) break;
+			pop_heap(candidates.begin(), candidates.end());
+			candidates.pop_back();
+			int n = read_links(c.second, level, copy.data());
+			for (int i = 0;i<n;++i) {
+				int e = copy[i];
+				if (visited[e] == visit) continue;
+				visited[e] = visit;
+				float d = distance(e, target);
+				if ((int)found.size()<ef || d<found.front().first) {
+					candidates.push_back(P(-d, e));
+					push_heap(candidates.begin(), candidates.end());
+					found.push_back(P(d, e));
+					push_heap(found.begin(), found.end());
+					if ((int)found.size()>ef) {
+						pop_heap(found.begin(), found.end());
+						found.pop_back();
+					}
+				}
+			}
+		}
+	}
+
+	// keeps at most n of the sorted candidates, each closer to the word than to the ones kept before
+	void select_neighbors(const vector<P> &sorted, int n, vector<int> &selected) {
+		selected.clear();
+		for (size_t i = 0;i<sorted.size() && (int)selected.size()<n;++i) {
+			bool good = true;
+			for (size_t j = 0;j<selected.size() && good;++j)
+				good = 1 - dot(sorted[i].second, selected[j]) >= sorted[i].first;
+			if (good) selected.push_back(sorted[i].second);
+		}
+	}
+
+	// level of a word from a hash of its id, so the levels do not depend on the order of insertion
+	int random_level(int id) {
+		unsigned long long h = (unsigned long long)id + 0x9E3779B97F4A7C15ULL;
+		h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+		h ^= h >> 31;
+		double u = ((h >> 11) + 1.) / 9007199254740993.;
+		return min(VLIB_HNSW_MAX_LEVEL, (int)(-log(u) / log((double)m)));
 	}
-	priority_queue<T, deque<T>, greater<T>> q;
-	for (int i = 0;i<tc;++i) {
-		for (int j = 0;j<k&&heap[i].size();++j) {
-			q.push(heap[i].top());
-			heap[i].pop();
+
+	void insert(int id) {
+		const float *target = M + (long long)id*vstride;
+		int level = levels[id];
+		vector<P> found;
+		vector<int> selected;
+		unique_lock<mutex> top(entry_lock);
+		int cur = entry, top_level = max_level;
+		// a new top level is linked before other words may enter through it
+		if (level <= top_level) top.unlock();
+		float dist = distance(cur, target);
+		for (int l = top_level;l>level;--l) cur = greedy(target, cur, dist, l);
+		for (int l = min(level, top_level);l >= 0;--l) {
+			search_layer(target, cur, dist, VLIB_HNSW_EF_CONSTRUCTION, l, found);
+			sort(found.begin(), found.end());
+			select_neighbors(found, m, selected);
+			{
+				lock_guard<mutex> guard((*node_locks)[id]);
+				int *row = links(id, l);
+				row[0] = selected.size();
+				memcpy(row + 1, selected.data(), selected.size() * sizeof(int));
+			}
+			for (size_t i = 0;i<selected.size();++i) {
+				int n = selected[i];
+				lock_guard<mutex> guard((*node_locks)[n]);
+				int *row = links(n, l);
+				if (row[0]<capacity(l)) {
+					row[1 + row[0]++] = id;
+					continue;
+				}
+				// full word keeps the best of its links and the new one
+				vector<P> sorted(1, P(1 - dot(n, id), id));
+				for (int j = 1;j <= row[0];++j) sorted.push_back(P(1 - dot(n, row[j]), row[j]));
+				sort(sorted.begin(), sorted.end());
+				vector<int> kept;
+				select_neighbors(sorted, capacity(l), kept);
+				row[0] = kept.size();
+				memcpy(row + 1, kept.data(), kept.size() * sizeof(int));
+			}
+			cur = found[0].second;
+			dist = found[0].first;
 		}
+		if (level>top_level) {
+			entry = id;
+			max_level = level;
+		}
+		++processed;
 	}
-	int n;
-	for (n = 0;n<k&&q.size();++n) {
-		tie(distances[n], results[n]) = q.top();
-		q.pop();
+}
+
+// builds the graph on all cores
+void build_hnsw() {
+	using namespace _hnsw;
+	if (links0 || !words) return;
+	fprintf(stderr, "Building HNSW graph...\r");
+	time_point1 = high_resolution_clock::now();
+	levels_data.resize(words);
+	upper_offset_data.resize(words);
+	long long upper_size = 0;
+	for (int i = 0;i<words;++i) {
+		levels_data[i] = random_level(i);
+		upper_offset_data[i] = upper_size;
+		upper_size += (long long)levels_data[i] * (m + 1);
+	}
+	links0_data.assign((long long)words*(2 * m + 1), 0);
+	upper_data.assign(upper_size, 0);
+	levels = levels_data.data();
+	upper_offset = upper_offset_data.data();
+	links0 = links0_data.data();
+	upper = upper_data.data();
+	node_locks = new vector<mutex>(words);
+	entry = 0;
+	max_level = levels[0];
+	processed = 1;
+	atomic<int> next(1);
+	vector<thread> workers;
+	for (int i = max(1, (int)thread::hardware_concurrency());i>0;--i) {
+		workers.push_back(thread([&] {
+			for (int id = next++;id<words;id = next++) insert(id);
+		}));
+	}
+	while (processed<words) {
+		this_thread::sleep_for(milliseconds(500));
+		fprintf(stderr, "Building HNSW graph...%2.2f%%\r", processed / (float)words * 100);
+	}
+	for (size_t i = 0;i<workers.size();++i) workers[i].join();
+	delete node_locks;
+	node_locks = NULL;
+	duration<double> time_span = duration_cast<duration<double>>(high_resolution_clock::now() - time_point1);
+	fprintf(stderr, "Building HNSW graph...ok (%lf seconds)\n", time_span.count());
+}
+
+// builds the graph if needed and writes it for map_hnsw()
+void write_hnsw(const char *filename) {
+	using namespace _hnsw;
+	vlib_hnsw_header header;
+	build_hnsw();
+	FILE *f = fopen(filename, "wb");
+	if (!f) err("Cannot create file: %s\n", filename);
+	fprintf(stderr, "Writing file %s...", filename);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VLIB_HNSW_MAGIC, 8);
+	header.words = words;
+	header.vsize = vsize;
+	header.m = m;
+	header.entry = entry;
+	header.max_level = max_level;
+	header.upper_size = words ? upper_offset[words - 1] + (long long)levels[words - 1] * (m + 1) : 0;
+	header.fingerprint = cache_fingerprint();
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(levels, sizeof(int), words, f);
+	fwrite(upper_offset, sizeof(long long), words, f);
+	fwrite(links0, sizeof(int), (long long)words*(2 * m + 1), f);
+	fwrite(upper, sizeof(int), header.upper_size, f);
+	if (ferror(f) | fclose(f)) err("Write error: %s\n", filename);
+	fprintf(stderr, "ok\n");
+}
+
+// maps the graph of the loaded vectors
+void map_hnsw(const char *filename) {
+	using namespace _hnsw;
+	size_t file_size;
+	char *base = map_file(filename, file_size);
+	const vlib_hnsw_header *header = (const vlib_hnsw_header*)base;
+	if (file_size<sizeof(*header) || memcmp(header->magic, VLIB_HNSW_MAGIC, 8)) err("Not a HNSW graph: %s\n", filename);
+	if (header->words != words || header->vsize != vsize || header->fingerprint != cache_fingerprint()) err("HNSW graph %s does not match the vectors\n", filename);
+	m = header->m;
+	size_t offset = sizeof(*header);
+	if (file_size<offset + (size_t)words*(sizeof(int) + sizeof(long long) + (2 * m + 1)*sizeof(int)) + header->upper_size*sizeof(int)) err("Read error: %s is too short\n", filename);
+	levels = (const int*)(base + offset);
+	offset += (size_t)words*sizeof(int);
+	upper_offset = (const long long*)(base + offset);
+	offset += (size_t)words*sizeof(long long);
+	links0 = (const int*)(base + offset);
+	offset += (size_t)words*(2 * m + 1)*sizeof(int);
+	upper = (const int*)(base + offset);
+	entry = header->entry;
+	max_level = header->max_level;
+}
+
+// approximate k nearest words of target in the graph, safe in many threads; returns the number found
+int hnsw_nearest(const float *target, int k, int *results, float *distances) {
+	using namespace _hnsw;
+	vector<P> found;
+	int n = 0;
+	if (entry >= 0 && k>0) {
+		int cur = entry;
+		float dist = distance(cur, target);
+		for (int l = max_level;l>0;--l) cur = greedy(target, cur, dist, l);
+		search_layer(target, cur, dist, max(hnsw_ef, k), 0, found);
+		sort(found.begin(), found.end());
+		n = min(k, (int)found.size());
+	}
+	for (int i = 0;i<n;++i) {
+		distances[i] = found[i].first;
+		results[i] = found[i].second;
 	}
 	if (n<k) memset(results + n, -1, sizeof(int)*(k - n));
-	t.clear();
-	heap.clear();
-	if (id != -1 && cache_results&&cache_distances) {
-		cache_results[id] = new int[k];
-		cache_distances[id] = new float[k];
-		memcpy(cache_results[id], results, sizeof(int)*k);
-		memcpy(cache_distances[id], distances, sizeof(float)*k);
+	return n;
+}
+
+// k nearest of c candidate words by dot(), -1 candidates are skipped
+int rerank_candidates(const float *target, int c, const int *ids, int k, int *results, float *distances) {
+	static thread_local top_k heap;
+	heap.reset(k);
+	for (int i = 0;i<c;++i) {
+		if (ids[i] >= 0) heap.push(_vp_tree::distance(ids[i], (float*)target), ids[i]);
+	}
+	return heap.extract(results, distances);
+}
+
+// query compared with the quantized rows, int8 ones get the query quantized the same way
+struct quantized_query {
+	const float *target;
+	vector<signed char> q;
+	float scale;
+};
+
+void quantize_query(const float *target, quantized_query &query) {
+	query.target = target;
+	if (quantized_type != VLIB_QUANTIZED_INT8) return;
+	query.q.resize(vsize);
+	query.scale = quantize_row(target, query.q.data());
+}
+
+inline float quantized_distance(int i, const quantized_query &query) {
+	const char *row = quantized_rows + (long long)i*quantized_stride;
+	if (quantized_type == VLIB_QUANTIZED_INT8)
+		return 1 - query.scale*quantized_scales[i] * dot_quantized_kernel.i8((const signed char*)row, query.q.data(), vsize);
+	return 1 - dot_quantized_kernel.f16(query.target, (const unsigned short*)row, vsize);
+}
+
+// number of quantized candidates searched for k neighbours
+inline int quantized_candidates(int k) {
+	return quantized_rerank ? max(k, min(words, k*quantized_rerank)) : k;
+}
+
+// k best of c quantized candidates, their distances are computed again in fp32 unless quantized_rerank is 0
+int quantized_rerank_candidates(const float *target, int c, const int *ids, const float *dists, int k, int *results, float *distances) {
+	if (quantized_rerank) return rerank_candidates(target, c, ids, k, results, distances);
+	int n = 0;
+	for (;n<k && ids[n] >= 0;++n) {
+		results[n] = ids[n];
+		distances[n] = dists[n];
 	}
+	if (n<k) memset(results + n, -1, sizeof(int)*(k - n));
 	return n;
 }
 
+// k nearest words of target by the quantized rows, returns the number found
+int quantized_nearest(const float *target, int k, int *results, float *distances) {
+	quantized_query query;
+	int c = quantized_candidates(k);
+	vector<int> ids(c);
+	vector<float> dists(c);
+	quantize_query(target, query);
+	k_nearest_pooled(c, ids.data(), dists.data(), [&](int i) { return quantized_distance(i, query); });
+	return quantized_rerank_candidates(target, c, ids.data(), dists.data(), k, results, distances);
+}
+
+// binary sketches of the rows of M: bit b tells the side of the random hyperplane b, so the hamming
+// distance of two sketches estimates the angle of the vectors; the planes go through the mean vector,
+// word vectors share a common direction and planes through 0 would split them unevenly; the scan
+// shortlists the sketch_candidates words of the nearest sketches and reranks them by dot()
+#define VLIB_SKETCH_BITS 256
+#define VLIB_SKETCH_WORDS (VLIB_SKETCH_BITS / 64)
+#define VLIB_SKETCH_CANDIDATES_DEFAULT 400
+#define VLIB_KNN_SKETCH 3
+
+int sketch_candidates = VLIB_SKETCH_CANDIDATES_DEFAULT;
+vector<float> sketch_planes;			// VLIB_SKETCH_BITS rows of vsize floats
+vector<float> sketch_offsets;			// dot product of every plane with the mean vector
+vector<unsigned long long> sketches;	// VLIB_SKETCH_WORDS per word
+
+inline int popcount64(unsigned long long x) {
+#if defined(_MSC_VER) && defined(_M_X64)
+	return (int)__popcnt64(x);
+#elif defined(__GNUC__)
+	return __builtin_popcountll(x);
+#else
+	x = x - (x >> 1 & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + (x >> 2 & 0x3333333333333333ULL);
+	return (int)(((x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL) * 0x0101010101010101ULL >> 56);
+#endif
+}
+
+void sketch_vector(const float *v, unsigned long long *sketch) {
+	memset(sketch, 0, VLIB_SKETCH_WORDS*sizeof(unsigned long long));
+	for (int b = 0;b<VLIB_SKETCH_BITS;++b) {
+		if (dot_kernel(&sketch_planes[(long long)b*vsize], v, vsize)>sketch_offsets[b]) sketch[b >> 6] |= 1ULL << (b & 63);
+	}
+}
+
+inline float sketch_distance(int i, const unsigned long long *sketch) {
+	const unsigned long long *row = &sketches[(long long)i*VLIB_SKETCH_WORDS];
+	int d = 0;
+	for (int w = 0;w<VLIB_SKETCH_WORDS;++w) d += popcount64(row[w] ^ sketch[w]);
+	return (float)d;
+}
+
+// hyperplanes of normally distributed components from a fixed seed, sketches of all words on the pool
+void build_sketches() {
+	using namespace _knn_pool;
+	unsigned long long seed = 88172645463325252ULL;
+	fprintf(stderr, "Building sketches...");
+	time_point1 = high_resolution_clock::now();
+	sketch_planes.resize((long long)VLIB_SKETCH_BITS*vsize);
+	for (size_t i = 0;i<sketch_planes.size();i += 2) {
+		double u[2];
+		for (int j = 0;j<2;++j) {
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			u[j] = ((seed >> 11) + 1.) / 9007199254740993.;
+		}
+		double radius = sqrt(-2 * log(u[0]));
+		sketch_planes[i] = (float)(radius*cos(6.283185307179586*u[1]));
+		if (i + 1<sketch_planes.size()) sketch_planes[i + 1] = (float)(radius*sin(6.283185307179586*u[1]));
+	}
+	vector<double> sum(vsize, 0);
+	vector<float> mean(vsize);
+	for (int i = 0;i<words;++i) {
+		for (int j = 0;j<vsize;++j) sum[j] += M[(long long)i*vstride + j];
+	}
+	for (int j = 0;j<vsize;++j) mean[j] = (float)(sum[j] / max(1, words));
+	sketch_offsets.resize(VLIB_SKETCH_BITS);
+	for (int b = 0;b<VLIB_SKETCH_BITS;++b) sketch_offsets[b] = dot_kernel(&sketch_planes[(long long)b*vsize], mean.data(), vsize);
+	sketches.assign((long long)words*VLIB_SKETCH_WORDS, 0);
+	lock_guard<mutex> guard(query_lock);
+	knn_pool_start();
+	int tc = workers.size();
+	knn_pool_run([&](int t) {
+		int a = words / tc*t, b = t + 1 == tc ? words : words / tc*(t + 1);
+		for (int i = a;i<b;++i) sketch_vector(M + (long long)i*vstride, &sketches[(long long)i*VLIB_SKETCH_WORDS]);
+	});
+	duration<double> time_span = duration_cast<duration<double>>(high_resolution_clock::now() - time_point1);
+	fprintf(stderr, "ok (%lf seconds)\n", time_span.count());
+}
+
+inline int sketch_shortlist(int k) {
+	return max(k, min(words, sketch_candidates));
+}
+
+// k nearest words of target among the shortlist of its sketch, returns the number found
+int sketch_nearest(const float *target, int k, int *results, float *distances) {
+	unsigned long long sketch[VLIB_SKETCH_WORDS];
+	int c = sketch_shortlist(k);
+	vector<int> ids(c);
+	vector<float> dists(c);
+	sketch_vector(target, sketch);
+	k_nearest_pooled(c, ids.data(), dists.data(), [&](int i) { return sketch_distance(i, sketch); });
+	return rerank_candidates(target, c, ids.data(), k, results, distances);
+}
+
+// nearest words of target by the selected backend, without the cache
+int knn_nearest(float *target, int k, int *results, float *distances) {
+	if (knn_backend == VLIB_KNN_VP_TREE) return vp_tree_nearest(target, k, results, distances);
+	if (knn_backend == VLIB_KNN_HNSW) return hnsw_nearest(target, k, results, distances);
+	if (knn_backend == VLIB_KNN_SKETCH) return sketch_nearest(target, k, results, distances);
+	if (quantized_rows) return quantized_nearest(target, k, results, distances);
+	return k_nearest_pooled(k, results, distances, [&](int i) { return _vp_tree::distance(i, target); });
+}
+
+int k_nearest3(float* target, int k, int* &results, float* &distances, int id = -1) {
+	//if (!results) results=new int[k];
+	//if (!distances) distances=new float[k];
+	return cache_get(id, k, results, distances, [&]() { return knn_nearest(target, k, results, distances); });
+}
+
+// compares the selected backend with the exact search on queries words spread over the vocabulary and
+// prints recall@k and the time of both
+void knn_recall(int queries, int k) {
+	vector<int> exact(k), approximate(k);
+	vector<float> distances(k);
+	double exact_time = 0, approximate_time = 0;
+	long long hits = 0;
+	char name[64];
+	if (knn_backend == VLIB_KNN_VP_TREE) sprintf(name, "vantage-point tree");
+	else if (knn_backend == VLIB_KNN_HNSW) sprintf(name, "HNSW (ef %d)", max(hnsw_ef, k));
+	else if (knn_backend == VLIB_KNN_SKETCH) sprintf(name, "sketches (%d candidates)", sketch_shortlist(k));
+	else if (quantized_rows) sprintf(name, "%s (rerank %d)", quantized_type == VLIB_QUANTIZED_INT8 ? "int8" : "fp16", quantized_rerank);
+	else sprintf(name, "scan");
+	queries = max(1, min(queries, words));
+	for (int q = 0;q<queries;++q) {
+		float *target = M + (long long)(words / queries*q)*vstride;
+		time_point1 = high_resolution_clock::now();
+		k_nearest_pooled(k, exact.data(), distances.data(), [&](int i) { return _vp_tree::distance(i, target); });
+		time_point2 = high_resolution_clock::now();
+		knn_nearest(target, k, approximate.data(), distances.data());
+		exact_time += duration_cast<duration<double>>(time_point2 - time_point1).count();
+		approximate_time += duration_cast<duration<double>>(high_resolution_clock::now() - time_point2).count();
+		for (int i = 0;i<k;++i) hits += exact[i] >= 0 && find(approximate.begin(), approximate.end(), exact[i]) != approximate.end();
+	}
+	printf("recall@%d of %s, %d queries: %.4f\n", k, name, queries, hits / (double)((long long)queries*k));
+	printf("exact: %.3f ms per query, %s: %.3f ms per query\n", exact_time * 1000 / queries, name, approximate_time * 1000 / queries);
+}
+
+// nearest words of target by the distance scaled with the weight of every word, on the pool of k_nearest3
+int k_nearest_weighted(const float *weights, float *target, int k, int *results, float *distances) {
+	if (!weights) err("Word counts are not loaded, see read_counts()\n");
+	return k_nearest_pooled(k, results, distances, [&](int i) { return weights[i] * _vp_tree::distance(i, target); });
+}
+
 int k_nearest3_idf(float* target, int k, int* &results, float* &distances) {
 	if (!results) results = new int[k];
 	if (!distances) distances = new float[k];
-	int tc = thread::hardware_concurrency() - no_threads;
-	using namespace _vp_tree;
-	priority_queue<T, deque<T>, greater<T>> q;
-	vector<priority_queue<T, deque<T>>> heap(tc);
-	vector<thread> t(tc);
-	for (int i = 0, a = 0, b;i<tc;++i, a = b) {
-		if (i + 1 == tc) b = words;
-		else b = words / tc*(i + 1);
-		t[i] = thread(k_nearest_v_idf, a, b, target, k, &heap[i]);
-	}
-	for (int i = 0;i<tc;++i) {
-		t[i].join();
-		for (int j = 0;j<k&&heap[i].size();++j) {
-			q.push(heap[i].top());
-			heap[i].pop();
-		}
-	}
-	int n;
-	for (n = 0;n<k&&q.size();++n) {
-		tie(distances[n], results[n]) = q.top();
-		q.pop();
-	}
-	if (n<k) memset(results + n, -1, sizeof(int)*(k - n));
-	t.clear();
-	heap.clear();
-	return n;
+	return k_nearest_weighted(idf_weights, target, k, results, distances);
 }
 
 int k_nearest3_imf(float* target, int k, int* &results, float* &distances) {
 	if (!results) results = (int*)malloc(k*sizeof(int));
 	if (!distances) distances = (float*)malloc(k*sizeof(float));
-	int tc = thread::hardware_concurrency() - no_threads;
-	using namespace _vp_tree;
-	priority_queue<T, deque<T>, greater<T>> q;
-	vector<priority_queue<T, deque<T>>> heap(tc);
-	vector<thread> t(tc);
-	for (int i = 0, a = 0, b;i<tc;++i, a = b) {
-		if (i + 1 == tc) b = words;
-		else b = words / tc*(i + 1);
-		t[i] = thread(k_nearest_v_imf, a, b, target, k, &heap[i]);
-	}
-	for (int i = 0;i<tc;++i) {
-		t[i].join();
-		for (int j = 0;j<k&&heap[i].size();++j) {
-			q.push(heap[i].top());
-			heap[i].pop();
-		}
-	}
-	int n;
-	for (n = 0;n<k&&q.size();++n) {
-		tie(distances[n], results[n]) = q.top();
-		q.pop();
+	return k_nearest_weighted(imf_weights, target, k, results, distances);
+}
+
+// tiles of the batched scan: rows of M kept in the L2 cache while a block of queries runs over them
+#define VLIB_BATCH_TILE_BYTES (256 * 1024)
+#define VLIB_BATCH_QUERIES 64
+
+// k nearest neighbours of q targets in one pass over the rows of row_bytes; every worker takes its
+// slice of the rows tile by tile and keeps a max-heap per target, distance_of(i, j) is the distance
+// of word i from target j; results and distances have k entries per target, returns the number of
+// neighbours found
+template<class F> int k_nearest_batched(int q, int k, size_t row_bytes, int *results, float *distances, F distance_of) {
+	using namespace _knn_pool;
+	lock_guard<mutex> guard(query_lock);
+	knn_pool_start();
+	int tc = workers.size(), rows = max(1, VLIB_BATCH_TILE_BYTES / (int)row_bytes);
+	batch_heaps.resize(tc);
+	knn_pool_run([&](int t) {
+		int a = words / tc*t, b = t + 1 == tc ? words : words / tc*(t + 1);
+		vector<top_k> &heaps = batch_heaps[t];
+		if ((int)heaps.size()<q) heaps.resize(q);
+		for (int j = 0;j<q;++j) heaps[j].reset(k);
+		for (int row = a;row<b;row += rows) {
+			int row_end = min(b, row + rows);
+			for (int query = 0;query<q;query += VLIB_BATCH_QUERIES) {
+				int query_end = min(q, query + VLIB_BATCH_QUERIES);
+				for (int i = row;i<row_end;++i) {
+					for (int j = query;j<query_end;++j) heaps[j].push(distance_of(i, j), i);
+				}
+			}
+		}
+	});
+	int found = 0;
+	for (int j = 0;j<q;++j) {
+		merged.reset(k);
+		for (int t = 0;t<tc;++t) merged.merge(batch_heaps[t][j]);
+		found = merged.extract(results + (long long)j*k, distances + (long long)j*k);
 	}
-	if (n<k) memset(results + n, -1, sizeof(int)*(k - n));
-	t.clear();
-	heap.clear();
+	return found;
+}
+
+// k nearest neighbours of q targets (q rows of vsize floats) in one pass over M
+int k_nearest3_batch(const float *targets, int q, int k, int *results, float *distances) {
+	return k_nearest_batched(q, k, vsize*sizeof(float), results, distances, [&](int i, int j) {
+		return 1 - dot_kernel(M + (long long)i*vstride, targets + (long long)j*vsize, vsize);
+	});
+}
+
+// the same by the quantized rows, candidates are checked in fp32 as in quantized_nearest()
+int quantized_nearest_batch(const float *targets, int q, int k, int *results, float *distances) {
+	int c = quantized_candidates(k), found = 0;
+	vector<quantized_query> queries(q);
+	vector<int> ids((long long)q*c);
+	vector<float> dists((long long)q*c);
+	for (int j = 0;j<q;++j) quantize_query(targets + (long long)j*vsize, queries[j]);
+	k_nearest_batched(q, c, quantized_stride, ids.data(), dists.data(), [&](int i, int j) { return quantized_distance(i, queries[j]); });
+	for (int j = 0;j<q;++j) {
+		found = quantized_rerank_candidates(targets + (long long)j*vsize, c, &ids[(long long)j*c], &dists[(long long)j*c], k,
+			results + (long long)j*k, distances + (long long)j*k);
+	}
+	return found;
+}
+
+// the same by the sketches, shortlists are reranked as in sketch_nearest()
+int sketch_nearest_batch(const float *targets, int q, int k, int *results, float *distances) {
+	int c = sketch_shortlist(k), found = 0;
+	vector<unsigned long long> target_sketches((long long)q*VLIB_SKETCH_WORDS);
+	vector<int> ids((long long)q*c);
+	vector<float> dists((long long)q*c);
+	for (int j = 0;j<q;++j) sketch_vector(targets + (long long)j*vsize, &target_sketches[(long long)j*VLIB_SKETCH_WORDS]);
+	k_nearest_batched(q, c, VLIB_SKETCH_WORDS*sizeof(unsigned long long), ids.data(), dists.data(), [&](int i, int j) {
+		return sketch_distance(i, &target_sketches[(long long)j*VLIB_SKETCH_WORDS]);
+	});
+	for (int j = 0;j<q;++j) {
+		found = rerank_candidates(targets + (long long)j*vsize, c, &ids[(long long)j*c], k, results + (long long)j*k, distances + (long long)j*k);
+	}
+	return found;
+}
+
+// k nearest words of all words of ids (-1 is skipped) into k ids per word of results, padded with -1;
+// cached words are copied, the others are searched with one batched pass and the words claimed here
+// are stored in the k-NN cache for later documents; the results never wait for the cache, so a small
+// or disabled cache costs no second search; returns false without filling results when the backend
+// answers single words fast, its indexes are searched by the threads asking for them
+bool k_nearest3_cached(const int *ids, int count, int k, int *results) {
+	if (knn_backend == VLIB_KNN_VP_TREE || knn_backend == VLIB_KNN_HNSW) return false;
+	vector<pair<int, int>> order;		// word id and position, sorted so that repeated words are searched once
+	vector<int> missing;
+	vector<char> claimed;
+	vector<float> distances(k);
+	for (int i = 0;i<count;++i) {
+		if (ids[i] >= 0) order.push_back(make_pair(ids[i], i));
+		else for (int j = 0;j<k;++j) results[(long long)i*k + j] = -1;
+	}
+	sort(order.begin(), order.end());
+	for (size_t i = 0;i<order.size();++i) {
+		if (i>0 && order[i].first == order[i - 1].first) continue;
+		int *row = results + (long long)order[i].second*k;
+		if (cache_lookup(order[i].first, k, row, distances.data())) continue;
+		// words computed by other threads are searched here again rather than waited for
+		missing.push_back(order[i].first);
+		claimed.push_back(cache_claim(order[i].first));
+	}
+	int q = missing.size();
+	if (q) {
+		vector<float> targets((long long)q*vsize), batch_distances((long long)q*k);
+		vector<int> batch_results((long long)q*k);
+		for (int j = 0;j<q;++j) memcpy(&targets[(long long)j*vsize], M + (long long)missing[j] * vstride, vsize*sizeof(float));
+		if (knn_backend == VLIB_KNN_SKETCH) sketch_nearest_batch(targets.data(), q, k, batch_results.data(), batch_distances.data());
+		else if (quantized_rows) quantized_nearest_batch(targets.data(), q, k, batch_results.data(), batch_distances.data());
+		else k_nearest3_batch(targets.data(), q, k, batch_results.data(), batch_distances.data());
+		for (int j = 0, i = 0;j<q;++j) {
+			if (claimed[j]) cache_store(missing[j], k, &batch_results[(long long)j*k], &batch_distances[(long long)j*k]);
+			for (;order[i].first != missing[j];++i);
+			memcpy(results + (long long)order[i].second*k, &batch_results[(long long)j*k], sizeof(int)*k);
+		}
+		lock_guard<mutex> guard(cache_lock);
+		if (cache_file) fflush(cache_file);
+	}
+	// repeated words copy the row of their first position
+	for (size_t i = 1;i<order.size();++i) {
+		if (order[i].first == order[i - 1].first) memcpy(results + (long long)order[i].second*k, results + (long long)order[i - 1].second*k, sizeof(int)*k);
+	}
+	return true;
+}
+
+// table of the k nearest neighbours of every word written by write_neighbor_table(): header and
+// words*k ids (-1 where fewer were found), only the vocabulary is needed to use it
+#define VLIB_NEIGHBORS_MAGIC "VLIBKNN2"
+#define VLIB_NEIGHBORS_BATCH 1024
+
+struct vlib_neighbors_header {
+	char magic[8];
+	int words, k;
+	unsigned long long fingerprint;		// of the vocabulary the ids index
+};
+
+const int *neighbor_table = NULL;
+int neighbor_table_k = 0;
+
+// computes neighbours of all words in batches of VLIB_NEIGHBORS_BATCH and writes the table
+void write_neighbor_table(const char *filename, int k) {
+	vlib_neighbors_header header;
+	vector<float> targets((long long)VLIB_NEIGHBORS_BATCH*vsize), distances((long long)VLIB_NEIGHBORS_BATCH*k);
+	vector<int> results((long long)VLIB_NEIGHBORS_BATCH*k);
+	clock_t last = clock();
+	FILE *f = fopen(filename, "wb");
+	if (!f) err("Cannot create file: %s\n", filename);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VLIB_NEIGHBORS_MAGIC, 8);
+	header.words = words;
+	header.k = k;
+	header.fingerprint = vocab_fingerprint();
+	fwrite(&header, sizeof(header), 1, f);
+	fprintf(stderr, "Writing file %s...\r", filename);
+	for (int a = 0;a<words;a += VLIB_NEIGHBORS_BATCH) {
+		int q = min(VLIB_NEIGHBORS_BATCH, words - a);
+		for (int j = 0;j<q;++j) memcpy(&targets[(long long)j*vsize], M + (long long)(a + j)*vstride, vsize*sizeof(float));
+		k_nearest3_batch(targets.data(), q, k, results.data(), distances.data());
+		fwrite(results.data(), sizeof(int), (long long)q*k, f);
+		if (clock() - last>CLOCKS_PER_SEC*.5) {
+			fprintf(stderr, "Writing file %s...%.2f%%\r", filename, (a + q)*100. / words);
+			last = clock();
+		}
+	}
+	if (ferror(f) | fclose(f)) err("Write error: %s\n", filename);
+	fprintf(stderr, "Writing file %s...100.00%%\n", filename);
+}
+
+// maps the table for the loaded vocabulary, it needs at least k neighbours of every word
+void map_neighbor_table(const char *filename, int k) {
+	size_t file_size;
+	char *base = map_file(filename, file_size);
+	const vlib_neighbors_header *header = (const vlib_neighbors_header*)base;
+	if (file_size<sizeof(*header) || memcmp(header->magic, VLIB_NEIGHBORS_MAGIC, 8)) err("Not a neighbour table: %s\n", filename);
+	if (header->words != words || header->fingerprint != vocab_fingerprint()) err("Neighbour table %s does not match the vocabulary\n", filename);
+	if (header->k<k) err("Neighbour table %s has %d neighbours of a word, %d are needed\n", filename, header->k, k);
+	if (file_size<sizeof(*header) + (size_t)words*header->k*sizeof(int)) err("Read error: %s is too short\n", filename);
+	neighbor_table = (const int*)(base + sizeof(*header));
+	neighbor_table_k = header->k;
+}
+
+// first k neighbours of the word from the table, returns how many were found
+inline int neighbor_table_lookup(int id, int k, int *results) {
+	const int *row = neighbor_table + (long long)id*neighbor_table_k;
+	int n = 0, found = min(k, neighbor_table_k);
+	for (;n<found && row[n] != -1;++n) results[n] = row[n];
+	for (int i = n;i<k;++i) results[i] = -1;
 	return n;
 }
 
@@ -779,37 +2647,52 @@ int k_nearest4(float*target, int k, int* &results, float* &distances) {
 }
 #endif
 
-int get_phrase_vector(char *s, float* &vector = _dummy) {
+// scratch of the phrase programs of one thread, it only grows
+struct phrase_scratch {
+	vector<float> v, score;
+	vector<int> count;
+	vector<phrase_match> matches;
+
+	void reserve(int len) {
+		if ((long long)v.size()<(len + 1LL)*vsize) v.resize((len + 1LL)*vsize);
+		if ((int)score.size()<len + 1) {
+			score.resize(len + 1);
+			count.resize(len + 1);
+		}
+	}
+};
+
+inline phrase_scratch& get_phrase_scratch() {
+	static thread_local phrase_scratch scratch;
+	return scratch;
+}
+
+// sum of the vectors of the entries covering the phrase, words without an entry are skipped at a cost
+// of 1e6; the phrase is split at spaces and '_' and kept as it is
+int get_phrase_vector(const char *s, float* &vector = _dummy) {
+	phrase_scratch &scratch = get_phrase_scratch();
 	int ok = 0, len = strlen(s), a, b, c;
-	float *tmp, *score, **v;
-	tmp = (float*)malloc(sizeof(float)*vsize);
-	score = (float*)calloc(len + 1, sizeof(float));
-	v = (float**)calloc(len + 1, sizeof(float*));
-	v[0] = (float*)calloc(vsize, sizeof(float));
+	scratch.reserve(len);
+	float *v = scratch.v.data(), *score = scratch.score.data();
+	int *reached = scratch.count.data();
+	memset(reached, 0, (len + 1)*sizeof(int));
+	memset(v, 0, vsize*sizeof(float));
+	score[0] = 0;
+	reached[0] = 1;
 	for (a = 0;a<len;++a) {
-		if (!s[a]) s[a] = ' ';
-		if (!v[a]) continue;
-		for (b = a;b<len;++b) {
-			if (s[b] == ' ') s[b] = '_';
-		}
-		s[b] = '_';
-		ok = 0;
-		for (;b>a;--b) {
-			if (s[b] == '_') {
-				s[b] = 0;
-				if (b == len) --b;
-				ok = get_word_vector(s + a, tmp);
-				//if (!ok) ok=get_word_vectori(s+a,tmp);
-				if (ok) {
-					float _score;
-					if (!score[a]) _score = 0;
-					else _score = dot(v[a], tmp);
-					if (!v[b + 1] || score[a] + _score <= score[b + 1]) {
-						if (!v[b + 1]) v[b + 1] = (float*)malloc(sizeof(float)*vsize);
-						score[b + 1] = score[a] + _score;
-						for (c = 0;c<vsize;++c) v[b + 1][c] = v[a][c] + tmp[c];
-					}
-				}
+		if (!reached[a]) continue;
+		ok = phrase_matches(s, len, a, scratch.matches);
+		// longer entries first, the later of equal scores wins
+		for (int m = (int)scratch.matches.size() - 1;m >= 0;--m) {
+			const float *w = M + (long long)scratch.matches[m].id*vstride;
+			float _score;
+			b = scratch.matches[m].end;
+			if (!score[a]) _score = 0;
+			else _score = dot(v + a*vsize, w);
+			if (!reached[b] || score[a] + _score <= score[b]) {
+				reached[b] = 1;
+				score[b] = score[a] + _score;
+				for (c = 0;c<vsize;++c) v[b*vsize + c] = v[a*vsize + c] + w[c];
 			}
 		}
 		if (!ok) {
@@ -817,59 +2700,40 @@ int get_phrase_vector(char *s, float* &vector = _dummy) {
 				if (s[b] == ' ') break;
 			}
 			if (b<len) ++b;
-			if (v[b]) continue;
+			if (reached[b]) continue;
 			score[b] = score[a] + 1e6;
-			v[b] = (float*)malloc(sizeof(float)*vsize);
-			memcpy(v[b], v[a], sizeof(float)*vsize);
+			reached[b] = 1;
+			memcpy(v + b*vsize, v + a*vsize, sizeof(float)*vsize);
 		}
 	}
 	if (ok) {
 		if (vector != _dummy) {
 			if (!vector) vector = new float[vsize];
-			memcpy(vector, v[len], sizeof(float)*vsize);
-		}
-	}
-	else {
-		if (!strchr(s, ' ')) {
-			//fprintf(stderr,"Cannot get the sense of \"%s\"\n",s);
+			memcpy(vector, v + len*vsize, sizeof(float)*vsize);
 		}
-		//exit(1);
 	}
-	for (a = 0;a<len;++a) {
-		if (v[a]) free(v[a]);
-	}
-	free(v);
-	free(tmp);
-	free(score);
 	return ok;
 }
 
-int get_phrase_vector2(char *s, float* &vector = _dummy) {
+// sum of the vectors of the fewest entries covering the phrase
+int get_phrase_vector2(const char *s, float* &vector = _dummy) {
+	phrase_scratch &scratch = get_phrase_scratch();
 	int ok = 0, len = strlen(s);
-	float *tmp = new float[vsize];
-	int *score = new int[len + 1];
+	scratch.reserve(len);
+	float *v = scratch.v.data();
+	int *score = scratch.count.data();
 	memset(score, -1, (len + 1)*sizeof(int));
-	float *v = new float[(len + 1)*vsize];
 	memset(v, 0, vsize*sizeof(float));
 	score[0] = 0;
-	for (int a = 0, b;a<len;++a) {
-		if (!s[a]) s[a] = ' ';
+	for (int a = 0;a<len;++a) {
 		if (score[a] == -1) continue;
-		for (b = a;b<len;++b) {
-			if (!s[b] || s[b] == ' ') s[b] = '_';
-		}
-		s[b] = '_';
-		for (;b>a;--b) {
-			if (s[b] == '_') {
-				s[b] = 0;
-				if (b == len) --b;
-				ok = get_word_vector(s + a, tmp);
-				if (ok) {
-					if (score[b + 1] == -1 || score[a] + 1<score[b + 1]) {
-						score[b + 1] = score[a] + 1;
-						for (int c = 0;c<vsize;++c) v[c + (b + 1)*vsize] = v[a*vsize + c] + tmp[c];
-					}
-				}
+		ok = phrase_matches(s, len, a, scratch.matches);
+		for (int m = (int)scratch.matches.size() - 1;m >= 0;--m) {
+			const float *w = M + (long long)scratch.matches[m].id*vstride;
+			int b = scratch.matches[m].end;
+			if (score[b] == -1 || score[a] + 1<score[b]) {
+				score[b] = score[a] + 1;
+				for (int c = 0;c<vsize;++c) v[c + b*vsize] = v[a*vsize + c] + w[c];
 			}
 		}
 	}
@@ -879,51 +2743,35 @@ int get_phrase_vector2(char *s, float* &vector = _dummy) {
 			memcpy(vector, v + len*vsize, vsize*sizeof(float));
 		}
 	}
-	else {
-		//if (!strchr(s,' ')){
-		//fprintf(stderr,"Cannot get the sense of \"%s\"\n",s);
-		//}
-		//exit(1);
-	}
-	delete[] v;
-	delete[] score;
-	delete[] tmp;
 	return ok;
 }
 
-int get_phrase_vector3(char *s, float* &vector = _dummy) {
+// normalized elementwise product of the vectors of the fewest entries covering the phrase
+int get_phrase_vector3(const char *s, float* &vector = _dummy) {
+	phrase_scratch &scratch = get_phrase_scratch();
 	int ok = 0, len = strlen(s);
-	float *tmp = new float[vsize];
-	int *score = new int[len + 1];
+	scratch.reserve(len);
+	float *v = scratch.v.data();
+	int *score = scratch.count.data();
 	memset(score, -1, (len + 1)*sizeof(int));
-	float *v = new float[(len + 1)*vsize];
 	for (int i = 0;i<vsize;++i) v[i] = 1;
 	score[0] = 0;
-	for (int a = 0, b;a<len;++a) {
-		if (!s[a]) s[a] = ' ';
+	for (int a = 0;a<len;++a) {
 		if (score[a] == -1) continue;
-		for (b = a;b<len;++b) {
-			if (!s[b] || s[b] == ' ') s[b] = '_';
-		}
-		s[b] = '_';
-		for (;b>a;--b) {
-			if (s[b] == '_') {
-				s[b] = 0;
-				if (b == len) --b;
-				ok = get_word_vector(s + a, tmp);
-				if (ok) {
-					if (score[b + 1] == -1 || score[a] + 1<score[b + 1]) {
-						score[b + 1] = score[a] + 1;
-						float sum = 0;
-						for (int c = 0;c<vsize;++c) {
-							float x = v[c + (b + 1)*vsize] = v[a*vsize + c] * tmp[c];
-							sum += x*x;
-						}
-						sum = sqrt(sum);
-						for (int c = 0;c<vsize;++c) {
-							v[c + (b + 1)*vsize] /= sum;
-						}
-					}
+		ok = phrase_matches(s, len, a, scratch.matches);
+		for (int m = (int)scratch.matches.size() - 1;m >= 0;--m) {
+			const float *w = M + (long long)scratch.matches[m].id*vstride;
+			int b = scratch.matches[m].end;
+			if (score[b] == -1 || score[a] + 1<score[b]) {
+				score[b] = score[a] + 1;
+				float sum = 0;
+				for (int c = 0;c<vsize;++c) {
+					float x = v[c + b*vsize] = v[a*vsize + c] * w[c];
+					sum += x*x;
+				}
+				sum = sqrt(sum);
+				for (int c = 0;c<vsize;++c) {
+					v[c + b*vsize] /= sum;
 				}
 			}
 		}
@@ -934,23 +2782,14 @@ int get_phrase_vector3(char *s, float* &vector = _dummy) {
 			memcpy(vector, v + len*vsize, vsize*sizeof(float));
 		}
 	}
-	else {
-		//if (!strchr(s,' ')){
-		//fprintf(stderr,"Cannot get the sense of \"%s\"\n",s);
-		//}
-		//exit(1);
-	}
-	delete[] v;
-	delete[] score;
-	delete[] tmp;
 	return ok;
 }
 
-int k_nearest3(char *target, int k, int* &results, float* &distances) {
+int k_nearest3(const char *target, int k, int* &results, float* &distances) {
 	float* v = NULL;
 	if (get_phrase_vector(target, v)) {
 		int ret = k_nearest3(v, k, results, distances);
-		free(v);
+		delete[] v;
 		return ret;
 	}
 	return 0;